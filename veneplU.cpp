@@ -1,38 +1,77 @@
 #define _X_OPEN_SOURCE
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 #include <wchar.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <regex>
 #include <stack>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 const char* CLEAR_EVERYTHING = "\x1b[2J\x1b[3J\x1b[H\x1b[0m";
+const char* BRACKETED_PASTE_ON = "\x1b[?2004h";
+const char* BRACKETED_PASTE_OFF = "\x1b[?2004l";
 const char* HEX_DIGITS = "0123456789ABCDEF";
 const char* DOZ_DIGITS = "0123456789XE";
 
 struct termios oldSettings;
+// Where keys come from and frames go. This is stdin, unless that is a
+// pipe, in which case it is /dev/tty.
+int terminal = 0;
+
+void writeTerminal(const std::string& s) {
+  (void) !write(terminal, s.data(), s.length());
+}
+
+void beep() {
+  writeTerminal("\a");
+}
 
 void saveCanonicalMode() {
-  tcgetattr(0, &oldSettings);
+  tcgetattr(terminal, &oldSettings);
 }
 
 void restoreCanonicalMode() {
-  tcsetattr(0, 0, &oldSettings);
-  std::cout << CLEAR_EVERYTHING;
+  tcsetattr(terminal, 0, &oldSettings);
+  writeTerminal(std::string(BRACKETED_PASTE_OFF) + CLEAR_EVERYTHING);
 }
 
 void setRawMode() {
@@ -41,17 +80,86 @@ void setRawMode() {
   newSettings.c_iflag &= ~(IXON | ICRNL);
   newSettings.c_cflag |= CS8;
   newSettings.c_lflag &= ~(ISIG | ICANON | ECHO);
-  tcsetattr(0, 0, &newSettings);
+  tcsetattr(terminal, 0, &newSettings);
+  // Have pastes come in as one unit instead of as typed keys
+  writeTerminal(BRACKETED_PASTE_ON);
 }
 
 void getTerminalDimensions(size_t& width, size_t& height) {
   // Issue an ioctl call
   struct winsize w;
-  ioctl(0, TIOCGWINSZ, &w);
+  ioctl(terminal, TIOCGWINSZ, &w);
   width = w.ws_col;
   height = w.ws_row;
 }
 
+// Lets background threads wake up the main loop, which polls on
+// fd() alongside the keyboard.
+class Waker {
+public:
+  Waker() : efd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+  int fd() const {
+    return efd;
+  }
+  void wake() {
+    uint64_t one = 1;
+    (void) !write(efd, &one, sizeof(one));
+  }
+  void drain() {
+    uint64_t n;
+    (void) !::read(efd, &n, sizeof(n));
+  }
+private:
+  int efd;
+};
+Waker waker;
+
+// Turns SIGWINCH into something the main loop can poll on. A burst of
+// resizes, as from dragging the edge of a window, is gathered up for
+// SETTLE_TIME milliseconds and then reported as one.
+class ResizeWatcher {
+public:
+  static constexpr long SETTLE_TIME = 20;
+  ResizeWatcher() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGWINCH);
+    // This runs before any thread is started, so every thread inherits
+    // the mask and the signal only ever turns up on signalFd.
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    signalFd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  }
+  int signalFd, timerFd;
+  // Called when signalFd is readable
+  void onSignal() {
+    struct signalfd_siginfo info;
+    while (read(signalFd, &info, sizeof(info)) == sizeof(info)) {}
+    if (settling) return;
+    struct itimerspec when = {};
+    when.it_value.tv_nsec = SETTLE_TIME * 1000000;
+    timerfd_settime(timerFd, 0, &when, nullptr);
+    settling = true;
+  }
+  // Called when timerFd is readable
+  void onTimer() {
+    uint64_t expirations;
+    (void) !read(timerFd, &expirations, sizeof(expirations));
+    settling = false;
+    resized = true;
+  }
+  // Has the terminal changed size since the last call?
+  bool take() {
+    bool r = resized;
+    resized = false;
+    return r;
+  }
+private:
+  bool settling = false;
+  bool resized = false;
+};
+ResizeWatcher resizes;
+
 int mkdirRecursive(std::string dir) {
   size_t lastSlash = dir.rfind('/');
   if (lastSlash != std::string::npos) {
@@ -71,13 +179,30 @@ std::string trimWhitespace(const std::string& s) {
   size_t end = s.find_last_not_of(WHITESPACE);
   if (begin == std::string::npos || end == std::string::npos)
     return std::move(std::string(""));
-  return std::move(s.substr(begin, end + 1));
+  return std::move(s.substr(begin, end - begin + 1));
 }
 
 std::string toLower(const std::string& s) {
   std::string t = s;
   for (char& c : t) c = tolower(c);
-  return std::move(t);
+  return t;
+}
+
+// Reads a size in bytes, which can end in k, M or G.
+bool parseSize(const std::string& s, size_t& out) {
+  char* end;
+  unsigned long long n = strtoull(s.c_str(), &end, 10);
+  if (end == s.c_str()) return false;
+  switch (*end) {
+    case '\0': break;
+    case 'k': case 'K': n <<= 10; ++end; break;
+    case 'm': case 'M': n <<= 20; ++end; break;
+    case 'g': case 'G': n <<= 30; ++end; break;
+    default: return false;
+  }
+  if (*end != '\0') return false;
+  out = n;
+  return true;
 }
 
 bool isTruthy(const std::string& s) {
@@ -263,82 +388,315 @@ enum SpecialKeys {
   SAVE_AS,
   DHR_MODE,
   RESET,
+  PASTE,
+  UNDO,
+  REDO,
+  FIND,
+  REPLACE,
+  STATS,
+  PAGE_UP,
+  PAGE_DOWN,
+  HOME,
+  END,
+  GOTO,
 };
 
-int get1c() {
-  errno = 0;
-  unsigned char c;
-  read(0, &c, 1);
-  if (errno == EINTR) return -1;
-  return c;
-}
-
-int getKey() {
-  using std::cin;
-  int c = get1c();
-  if (c == -1) return SpecialKeys::RESET;
-  unsigned char c1 = c;
-  if (c1 == 127) return SpecialKeys::BACKSPACE;
-  if (c1 >= 32) {
-    if (isASCII(c1)) return c1;
-    else if (isContinuation(c1) || c1 >= 248) {
-      return -c1;
-    } else  {
+// Reads the keyboard in large chunks into a ring buffer and decodes keys
+// from there. Escape sequences and UTF-8 sequences that arrive split
+// across reads are put back together; if the rest of one does not show
+// up within ESCAPE_TIMEOUT milliseconds, we take what we have at face value.
+class KeyReader {
+public:
+  explicit KeyReader(int fd = 0) : fd(fd) {}
+  int getFd() const {
+    return fd;
+  }
+  // Are there keys or bytes read but not handed out yet?
+  bool pending() const {
+    return count > 0 || !queued.empty();
+  }
+  int getKey() {
+    if (!queued.empty()) {
+      auto [key, text] = std::move(queued.front());
+      queued.pop_front();
+      if (key == SpecialKeys::PASTE) pasted = std::move(text);
+      return key;
+    }
+    return readKey();
+  }
+  // Reads in whatever has been typed, without waiting, and takes out the
+  // first QUIT in it. Every other key stays queued for getKey(). The end
+  // of the input does not count as a QUIT here.
+  bool takeQuit() {
+    while (fill(0) > 0) {}
+    while (true) {
+      int key = decode(false);
+      if (key == INCOMPLETE) break;
+      queued.push_back({key, key == SpecialKeys::PASTE ? pasted : ""});
+    }
+    for (auto it = queued.begin(); it != queued.end(); ++it) {
+      if (it->first == SpecialKeys::QUIT) {
+        queued.erase(it);
+        return true;
+      }
+    }
+    return false;
+  }
+  // The text of the last paste, when getKey() returns SpecialKeys::PASTE
+  std::string pasted;
+private:
+  static constexpr int INCOMPLETE = -1000000;
+  static constexpr int ESCAPE_TIMEOUT = 50;
+  static constexpr size_t CAPACITY = 65536;
+  static constexpr size_t MASK = CAPACITY - 1;
+  int readKey() {
+    while (true) {
+      int key = decode(false);
+      if (key != INCOMPLETE) return key;
+      int got = fill(count == 0 ? -1 : ESCAPE_TIMEOUT);
+      if (got < 0) return SpecialKeys::RESET;
+      if (got == 0) {
+        // End of input
+        if (count == 0) return SpecialKeys::QUIT;
+        return decode(true);
+      }
+    }
+  }
+  // Tries to decode a key from the start of the buffer. Unless final is
+  // set, it returns INCOMPLETE if the key could still go on.
+  int decode(bool final) {
+    if (count == 0) return INCOMPLETE;
+    unsigned char c1 = at(0);
+    if (c1 == 127) {
+      consume(1);
+      return SpecialKeys::BACKSPACE;
+    }
+    if (c1 >= 32) {
+      if (isASCII(c1) || isContinuation(c1) || c1 >= 248) {
+        consume(1);
+        return isASCII(c1) ? c1 : -c1;
+      }
       size_t expectedContinuations = expectedContinuationBytes(c1);
       int codepoint = c1 - starterOffsets[expectedContinuations - 1];
-      bool ok = true;
-      size_t k;
-      for (k = 1; k <= expectedContinuations; ++k) {
-        unsigned char cont = cin.get();
+      for (size_t k = 1; k <= expectedContinuations; ++k) {
+        if (k >= count) {
+          if (!final) return INCOMPLETE;
+          consume(1);
+          return -c1;
+        }
+        unsigned char cont = at(k);
         if (!isContinuation(cont)) {
-          ok = false;
-          break;
+          // Only the starter is invalid; the rest gets decoded anew.
+          consume(1);
+          return -c1;
         }
         codepoint = (codepoint << 6) | (cont & 0x7f);
       }
-      if (!ok) {
-        codepoint = -c1;
-        for (size_t j = 1; j <= k; ++j) {
-          cin.unget();
-        }
-      }
+      consume(expectedContinuations + 1);
       return codepoint;
     }
+    if (c1 == 27) return decodeEscape(final);
+    // Ctrl-\ changes the key after it, so wait for that.
+    if (c1 == 28 && count < 2 && !final) return INCOMPLETE;
+    consume(1);
+    if (c1 == 13) return SpecialKeys::ENTER;
+    if (c1 == 17) return SpecialKeys::QUIT;
+    if (c1 == 19) return SpecialKeys::SAVE;
+    if (c1 == 3) return SpecialKeys::COPY;
+    if (c1 == 28) {
+      int codepoint = readKey();
+      switch (codepoint) {
+      case SpecialKeys::SAVE:
+        return SpecialKeys::SAVE_AS;
+      default:
+        return codepoint;
+      }
+    }
+    if (c1 == 4) return SpecialKeys::DHR_MODE;
+    if (c1 == 26) return SpecialKeys::UNDO;
+    if (c1 == 25) return SpecialKeys::REDO;
+    if (c1 == 6) return SpecialKeys::FIND;
+    if (c1 == 18) return SpecialKeys::REPLACE;
+    if (c1 == 20) return SpecialKeys::STATS;
+    if (c1 == 7) return SpecialKeys::GOTO;
+    return SpecialKeys::UNKNOWN;
   }
-  if (c1 == 13) return SpecialKeys::ENTER;
-  if (c1 == 27) {
-    char c2 = cin.get();
-    if (c2 == 91) {
-      char c3 = cin.get();
-      switch (c3) {
-        case 65: return SpecialKeys::UP;
-        case 66: return SpecialKeys::DOWN;
-        case 68: return SpecialKeys::LEFT;
-        case 67: return SpecialKeys::RIGHT;
-        case 51: {
-          char c4 = cin.get();
-          if (c4 == 126) return SpecialKeys::DELETE;
+  int decodeEscape(bool final) {
+    if (count < 2) {
+      if (!final) return INCOMPLETE;
+      // A lone ESC
+      consume(1);
+      return SpecialKeys::UNKNOWN;
+    }
+    unsigned char c2 = at(1);
+    if (c2 == '[') {
+      // CSI: parameter and intermediate bytes, then a final byte
+      size_t i = 2;
+      while (i < count && i < MAX_SEQUENCE && at(i) >= 0x20 && at(i) < 0x40)
+        ++i;
+      if (i == count) {
+        if (!final) return INCOMPLETE;
+        consume(count);
+        return SpecialKeys::UNKNOWN;
+      }
+      unsigned char f = at(i);
+      std::string params;
+      for (size_t j = 2; j < i; ++j) params += at(j);
+      consume(i + 1);
+      switch (f) {
+        case 'A': return SpecialKeys::UP;
+        case 'B': return SpecialKeys::DOWN;
+        case 'C': return SpecialKeys::RIGHT;
+        case 'D': return SpecialKeys::LEFT;
+        case 'H': return SpecialKeys::HOME;
+        case 'F': return SpecialKeys::END;
+        case '~':
+          if (params == "3") return SpecialKeys::DELETE;
+          if (params == "5") return SpecialKeys::PAGE_UP;
+          if (params == "6") return SpecialKeys::PAGE_DOWN;
+          if (params == "1" || params == "7") return SpecialKeys::HOME;
+          if (params == "4" || params == "8") return SpecialKeys::END;
+          if (params == "200") {
+            readPaste();
+            return SpecialKeys::PASTE;
+          }
           return SpecialKeys::UNKNOWN;
-        }
         default: return SpecialKeys::UNKNOWN;
       }
     }
+    if (c2 == 'O') {
+      // SS3, which some terminals use for the arrow keys
+      if (count < 3) {
+        if (!final) return INCOMPLETE;
+        consume(count);
+        return SpecialKeys::UNKNOWN;
+      }
+      unsigned char f = at(2);
+      consume(3);
+      switch (f) {
+        case 'A': return SpecialKeys::UP;
+        case 'B': return SpecialKeys::DOWN;
+        case 'C': return SpecialKeys::RIGHT;
+        case 'D': return SpecialKeys::LEFT;
+        case 'H': return SpecialKeys::HOME;
+        case 'F': return SpecialKeys::END;
+        default: return SpecialKeys::UNKNOWN;
+      }
+    }
+    // Alt plus some key; we don't use those.
+    consume(2);
     return SpecialKeys::UNKNOWN;
   }
-  if (c1 == 17) return SpecialKeys::QUIT;
-  if (c1 == 19) return SpecialKeys::SAVE;
-  if (c1 == 3) return SpecialKeys::COPY;
-  if (c1 == 28) {
-    int codepoint = getKey();
-    switch (codepoint) {
-    case SpecialKeys::SAVE:
-      return SpecialKeys::SAVE_AS;
-    default:
-      return codepoint;
+  // Reads the rest of a bracketed paste, in bulk, up to the marker
+  // that ends it.
+  void readPaste() {
+    static const std::string END = "\x1b[201~";
+    pasted.clear();
+    while (count > 0) {
+      pasted += at(0);
+      consume(1);
+    }
+    size_t searchFrom = 0;
+    while (true) {
+      size_t end = pasted.find(END, searchFrom);
+      if (end != std::string::npos) {
+        // Anything after the marker is for later.
+        size_t after = end + END.length();
+        push(pasted.data() + after, pasted.length() - after);
+        pasted.resize(end);
+        return;
+      }
+      // The marker might be split between two reads.
+      searchFrom = pasted.length() >= END.length() - 1 ?
+        pasted.length() - (END.length() - 1) : 0;
+      size_t old = pasted.length();
+      pasted.resize(old + CAPACITY);
+      ssize_t n = read(fd, &pasted[old], CAPACITY);
+      pasted.resize(old + std::max<ssize_t>(n, 0));
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return;
+    }
+  }
+  // Waits up to timeout milliseconds (forever if negative) for more
+  // input, then reads as much as fits. Returns the number of bytes read,
+  // 0 on a timeout or end of input, or -1 if interrupted.
+  int fill(int timeout) {
+    if (timeout >= 0) {
+      struct pollfd pfd = {fd, POLLIN, 0};
+      int stat = poll(&pfd, 1, timeout);
+      if (stat < 0) return errno == EINTR ? -1 : 0;
+      if (stat == 0) return 0;
+    }
+    size_t tail = (head + count) & MASK;
+    size_t room = std::min(CAPACITY - count, CAPACITY - tail);
+    ssize_t n = read(fd, ring + tail, room);
+    if (n < 0) return errno == EINTR ? -1 : 0;
+    count += n;
+    return n;
+  }
+  void push(const char* s, size_t n) {
+    for (size_t i = 0; i < n && count < CAPACITY; ++i) {
+      ring[(head + count) & MASK] = s[i];
+      ++count;
     }
   }
-  if (c1 == 4) return SpecialKeys::DHR_MODE;
-  return SpecialKeys::UNKNOWN;
+  unsigned char at(size_t i) const {
+    return ring[(head + i) & MASK];
+  }
+  void consume(size_t n) {
+    head = (head + n) & MASK;
+    count -= n;
+  }
+  // Longest CSI sequence we bother with
+  static constexpr size_t MAX_SEQUENCE = 32;
+  int fd;
+  char ring[CAPACITY];
+  size_t head = 0, count = 0;
+  // Keys decoded ahead by takeQuit(), with the text of any paste
+  std::deque<std::pair<int, std::string>> queued;
+};
+KeyReader keyboard;
+
+int getKey() {
+  return keyboard.getKey();
+}
+
+// Like waitForKey(), but only counts keys that have not been read from
+// the keyboard yet.
+bool waitForInput(int timeout = -1) {
+  struct pollfd fds[4] = {
+    {keyboard.getFd(), POLLIN, 0},
+    {waker.fd(), POLLIN, 0},
+    {resizes.signalFd, POLLIN, 0},
+    {resizes.timerFd, POLLIN, 0},
+  };
+  while (true) {
+    int ready = poll(fds, 4, timeout);
+    if (ready <= 0) return false;
+    if (fds[2].revents != 0) resizes.onSignal();
+    if (fds[3].revents != 0) resizes.onTimer();
+    // End of input counts as a key, which getKey() turns into QUIT.
+    if (fds[0].revents != 0) return true;
+    if (fds[1].revents != 0 || fds[3].revents != 0) return false;
+    // Only a resize that has not settled yet; nothing to draw for that.
+    if (timeout >= 0) return false;
+  }
+}
+
+// Waits until a key is pressed, the main loop is woken up, the terminal
+// settles on a new size or timeout milliseconds go by. Returns true in
+// the first case; otherwise the caller should see to its background jobs
+// and draw, which picks up the new size.
+bool waitForKey(int timeout = -1) {
+  if (keyboard.pending()) return true;
+  return waitForInput(timeout);
+}
+
+// Is there a key waiting to be read already?
+bool keyPending() {
+  if (keyboard.pending()) return true;
+  struct pollfd fd = {keyboard.getFd(), POLLIN, 0};
+  return poll(&fd, 1, 0) > 0 && (fd.revents & POLLIN) != 0;
 }
 
 template<typename N> std::string toString(N n) {
@@ -359,6 +717,19 @@ template<typename N> std::string toString(N n) {
   return s;
 }
 
+// Reads a number written the way toString() writes it.
+bool parseDozenal(const std::string& s, size_t& out) {
+  if (s.empty()) return false;
+  size_t n = 0;
+  for (char c : s) {
+    const char* digit = strchr(DOZ_DIGITS, toupper(c));
+    if (c == '\0' || digit == nullptr) return false;
+    n = n * 12 + (digit - DOZ_DIGITS);
+  }
+  out = n;
+  return true;
+}
+
 const char* VOWELS = "aeiouy";
 class DHRBox {
 public:
@@ -424,255 +795,3892 @@ private:
 // My personal favourite
 constexpr size_t TAB_WIDTH = 2;
 
+// The width of every codepoint, as wcwidth() has it in our locale.
+// Looking one up takes two loads: the high bits pick out a block of 256
+// codepoints, and then the low bits pick the width in that block.
+// Blocks that come out the same are only stored once.
+class WidthTable {
+public:
+  // Needs to be done once the locale is set.
+  void build() {
+    std::map<std::string, uint16_t> seen;
+    index.resize(CODEPOINTS / BLOCK);
+    blocks.clear();
+    std::string block(BLOCK, 0);
+    for (size_t b = 0; b < index.size(); ++b) {
+      for (size_t i = 0; i < BLOCK; ++i)
+        block[i] = (char) wcwidth(b * BLOCK + i);
+      auto it = seen.find(block);
+      if (it == seen.end()) {
+        it = seen.emplace(block, blocks.size() / BLOCK).first;
+        blocks.insert(blocks.end(), block.begin(), block.end());
+      }
+      index[b] = it->second;
+    }
+  }
+  // -1 for anything unprintable
+  int get(int codepoint) const {
+    if (codepoint < 0 || (size_t) codepoint >= CODEPOINTS) return -1;
+    return blocks[index[codepoint / BLOCK] * BLOCK + codepoint % BLOCK];
+  }
+private:
+  static constexpr size_t CODEPOINTS = 0x110000;
+  static constexpr size_t BLOCK = 256;
+  std::vector<uint16_t> index;
+  std::vector<signed char> blocks;
+};
+WidthTable widthTable;
+
 size_t wcwidthp(int codepoint) {
   // Tab width is configurable
   if (codepoint == '\t') return TAB_WIDTH;
   // Invalid byte characters are drawn as their hex in reverse video
   // Control characters are drawn as ^ plus another character
   if (codepoint < 32 || codepoint == 127) return 2;
-  return wcwidth(codepoint);
+  if (codepoint < 127) return 1;
+  // Other unprintable characters are drawn as a ?
+  int w = widthTable.get(codepoint);
+  return w < 0 ? 1 : w;
 }
 
-size_t wcswidthp(const std::string& s) {
-  size_t sum = 0;
-  UTF8Iterator<const std::string> begin(s), end(s, true);
-  while (begin != end) {
-    int codepoint = begin.getAndAdvance();
-    sum += wcwidthp(codepoint);
+// Most text is long runs of ASCII, which we can measure a block at a
+// time without decoding anything. Every printable ASCII character is
+// one column wide, and tabs, control characters and DEL are two
+// (TAB_WIDTH has to stay 2 for this to hold).
+static_assert(TAB_WIDTH == 2, "ASCII blocks assume tabs are two columns");
+
+// Bytes in a 64-bit word that are control characters or DEL,
+// given that none of them have the high bit set
+inline int countControlsWord(uint64_t x) {
+  constexpr uint64_t ONES = 0x0101010101010101;
+  uint64_t controls = ~(x + 0x60 * ONES) | (x + ONES);
+  return __builtin_popcountll(controls & (0x80 * ONES));
+}
+
+// Each of these takes as many whole blocks of pure ASCII from the
+// start of [p, p + n) as it can without width going past limit,
+// adds their width to width and returns how many bytes they covered.
+size_t asciiBlocksScalar(const char* p, size_t n,
+    size_t& width, size_t limit) {
+  constexpr uint64_t HIGH = 0x8080808080808080;
+  size_t i = 0;
+  while (i + 8 <= n) {
+    uint64_t x;
+    memcpy(&x, p + i, 8);
+    if ((x & HIGH) != 0) break;
+    size_t w = 8 + countControlsWord(x);
+    if (limit - width < w) break;
+    width += w;
+    i += 8;
   }
-  return sum;
+  return i;
+}
+
+#if defined(__x86_64__)
+// SSE2 comes with every x86-64 processor.
+size_t asciiBlocksSSE2(const char* p, size_t n,
+    size_t& width, size_t limit) {
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i del = _mm_set1_epi8(127);
+  size_t i = 0;
+  while (i + 16 <= n) {
+    __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+    if (_mm_movemask_epi8(v) != 0) break;
+    __m128i controls = _mm_or_si128(
+      _mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del));
+    size_t w = 16 + __builtin_popcount(_mm_movemask_epi8(controls));
+    if (limit - width < w) break;
+    width += w;
+    i += 16;
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+size_t asciiBlocksAVX2(const char* p, size_t n,
+    size_t& width, size_t limit) {
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i del = _mm256_set1_epi8(127);
+  size_t i = 0;
+  while (i + 32 <= n) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) (p + i));
+    if (_mm256_movemask_epi8(v) != 0) break;
+    __m256i controls = _mm256_or_si256(
+      _mm256_cmpgt_epi8(space, v), _mm256_cmpeq_epi8(v, del));
+    size_t w = 32 +
+      __builtin_popcount((unsigned) _mm256_movemask_epi8(controls));
+    if (limit - width < w) break;
+    width += w;
+    i += 32;
+  }
+  // Leave the last few to SSE2.
+  return i + asciiBlocksSSE2(p + i, n - i, width, limit);
 }
 
-size_t wcswidthp(const std::string& s, size_t len) {
+const bool hasAVX2 = __builtin_cpu_supports("avx2");
+#endif
+
+// Measures the ASCII at the start of [p, p + n), stopping at the first
+// byte that is not ASCII or once width reaches limit. Returns how many
+// bytes it took.
+size_t measureASCII(const char* p, size_t n, size_t& width,
+    size_t limit = SIZE_MAX) {
+#if defined(__x86_64__)
+  size_t i = hasAVX2 ?
+    asciiBlocksAVX2(p, n, width, limit) :
+    asciiBlocksSSE2(p, n, width, limit);
+#else
+  size_t i = asciiBlocksScalar(p, n, width, limit);
+#endif
+  while (i < n && width < limit && isASCII((unsigned char) p[i])) {
+    width += wcwidthp((unsigned char) p[i]);
+    ++i;
+  }
+  return i;
+}
+
+// Where the bytes starting at s[i] are stored, and how many of them
+// are stored together
+inline std::pair<const char*, size_t> textRun(const std::string& s, size_t i) {
+  return {s.data() + i, s.length() - i};
+}
+
+// Width of the bytes in [from, to); from must start a codepoint.
+template<typename S>
+size_t wcswidthp(const S& s, size_t from, size_t to) {
   size_t sum = 0;
-  UTF8Iterator<const std::string> begin(s), end(s, len);
-  while (begin != end) {
-    int codepoint = begin.getAndAdvance();
-    sum += wcwidthp(codepoint);
+  size_t i = from;
+  while (i < to) {
+    auto [p, n] = textRun(s, i);
+    n = std::min(n, to - i);
+    size_t ascii = measureASCII(p, n, sum);
+    i += ascii;
+    if (ascii == n) continue;
+    // Only decode what isn't ASCII.
+    UTF8Iterator<const S> it(s, i);
+    sum += wcwidthp(it.getAndAdvance());
+    i = it.position();
   }
   return sum;
 }
 
-size_t unwcswidthp(const std::string& s, size_t vlen) {
+template<typename S>
+size_t wcswidthp(const S& s, size_t len) {
+  return wcswidthp(s, 0, len);
+}
+
+template<typename S>
+size_t wcswidthp(const S& s) {
+  return wcswidthp(s, 0, s.length());
+}
+
+// Where the text starting at from reaches a width of vlen
+template<typename S>
+size_t unwcswidthp(const S& s, size_t vlen, size_t from = 0) {
   size_t sum = 0;
-  UTF8Iterator<const std::string> begin(s), end(s, true);
-  while (sum < vlen && begin != end) {
-    int codepoint = begin.getAndAdvance();
-    sum += wcwidthp(codepoint);
+  size_t i = from;
+  size_t len = s.length();
+  while (i < len && sum < vlen) {
+    auto [p, n] = textRun(s, i);
+    size_t ascii = measureASCII(p, n, sum, vlen);
+    i += ascii;
+    if (ascii == n || sum >= vlen) continue;
+    UTF8Iterator<const S> it(s, i);
+    sum += wcwidthp(it.getAndAdvance());
+    i = it.position();
   }
-  return begin.position();
+  return i;
 }
 
-// Define a global variable so the signal handler can use it
-class Buffer;
-Buffer* globalBuffer = nullptr;
+#if defined(__x86_64__)
+// Each of these looks for needle, which is m >= 2 bytes long, starting
+// at i or after it in [p, p + n). The first and last bytes of needle
+// are checked for a block of places at a time, and the rest is only
+// compared where both of them match. On a match they return true with
+// i where it starts; otherwise they stop short of the last few places.
+bool findBlocksSSE2(const char* p, size_t n,
+    const char* needle, size_t m, size_t& i) {
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[m - 1]);
+  while (i + 16 + m - 1 <= n) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (p + i));
+    __m128i b = _mm_loadu_si128((const __m128i*) (p + i + m - 1));
+    unsigned mask = _mm_movemask_epi8(
+      _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask != 0) {
+      int k = __builtin_ctz(mask);
+      if (memcmp(p + i + k + 1, needle + 1, m - 2) == 0) {
+        i += k;
+        return true;
+      }
+      mask &= mask - 1;
+    }
+    i += 16;
+  }
+  return false;
+}
 
-// Options
+__attribute__((target("avx2")))
+bool findBlocksAVX2(const char* p, size_t n,
+    const char* needle, size_t m, size_t& i) {
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+  while (i + 32 + m - 1 <= n) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (p + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*) (p + i + m - 1));
+    unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+      _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask != 0) {
+      int k = __builtin_ctz(mask);
+      if (memcmp(p + i + k + 1, needle + 1, m - 2) == 0) {
+        i += k;
+        return true;
+      }
+      mask &= mask - 1;
+    }
+    i += 32;
+  }
+  // Leave the last few to SSE2.
+  return findBlocksSSE2(p, n, needle, m, i);
+}
+#endif
 
-enum BoolOptions {
-  B_LINE_NUMBERS = 0,
-  // add new ones before this line
-  B_COUNT
-};
-const std::unordered_map<std::string, size_t> boolOptionsByName = {
-  {"vatarika", 0},
+// Where needle first shows up in [p, p + n), or std::string::npos
+size_t findBytes(const char* p, size_t n, const std::string& needle) {
+  size_t m = needle.length();
+  if (m == 0) return 0;
+  if (m > n) return std::string::npos;
+  if (m == 1) {
+    const void* at = memchr(p, needle[0], n);
+    return at == nullptr ? std::string::npos : (const char*) at - p;
+  }
+  size_t i = 0;
+#if defined(__x86_64__)
+  if (hasAVX2 ?
+      findBlocksAVX2(p, n, needle.data(), m, i) :
+      findBlocksSSE2(p, n, needle.data(), m, i))
+    return i;
+#endif
+  // Elsewhere, and for the last few places, memchr does the filtering.
+  while (i + m <= n) {
+    const void* at = memchr(p + i, needle[0], n - m + 1 - i);
+    if (at == nullptr) break;
+    i = (const char*) at - p;
+    if (memcmp(p + i + 1, needle.data() + 1, m - 1) == 0) return i;
+    ++i;
+  }
+  return std::string::npos;
+}
+
+// The size of a page, for onBusError(), which cannot ask for it
+size_t pageSize = 4096;
+
+// Where the files mapped by MappedFile::open() are, so that onBusError()
+// can tell their pages from anything else. begin is 0 for a free slot
+// and 1 for one being filled in.
+struct GuardedRange {
+  std::atomic<uintptr_t> begin{0}, end{0};
+  // Set once a page of the range has been replaced with zeros
+  std::atomic<bool> cut{false};
 };
+constexpr size_t MAX_GUARDED = 64;
+GuardedRange guarded[MAX_GUARDED];
 
-class Buffer {
-public:
-  std::vector<std::string> lines;
-  std::vector<size_t> vlengths;
-  // cursorCol can extend beyond the line length, but that
-  // is treated as the end of that line
-  size_t cursorRow = 0, cursorCol = 0;
-  size_t cursorVCol = 0;
-  size_t scrollRow = 0;
-  size_t scrollCol = 0;
-  size_t scrollVCol = 0;
-  size_t width, height;
-  bool shouldResize = false;
-  bool dirty = false;
-  bool prompting = false;
-  bool first = true;
-  std::string message;
-  std::string promptInput;
-  size_t promptVLength;
-  int messageColour;
-  std::string filename;
-  DHRBox box;
-  bool isDHR = false;
-  class Options {
-  public:
-    Options() :
-      boolOptions(BoolOptions::B_COUNT) {}
-    bool lineno() const { return boolOptions[BoolOptions::B_LINE_NUMBERS]; }
-    std::vector<bool> boolOptions;
-  };
-  Options options;
-  Buffer() {
-    getTerminalDimensions(width, height);
-    registerHandler();
-    addLineAtBack("");
-    readOptions();
+// Returns the slot for [p, p + n), or MAX_GUARDED if they are all taken.
+size_t guardRange(const char* p, size_t n) {
+  for (size_t i = 0; i < MAX_GUARDED; ++i) {
+    uintptr_t expected = 0;
+    if (!guarded[i].begin.compare_exchange_strong(expected, 1)) continue;
+    guarded[i].cut = false;
+    guarded[i].end = (uintptr_t) (p + n);
+    guarded[i].begin = (uintptr_t) p;
+    return i;
   }
-  void read(const char* fname) {
-    lines.clear();
-    vlengths.clear();
-    filename = fname;
-    std::ifstream fh(fname, std::ios::binary);
-    if (fh.fail()) {
-      dirty = true;
+  return MAX_GUARDED;
+}
+
+void unguardRange(size_t slot) {
+  if (slot < MAX_GUARDED) guarded[slot].begin = 0;
+}
+
+// Reading a mapped page past the end of a file that something else has
+// cut short raises SIGBUS. If the page belongs to one of the guarded
+// mappings, put a page of zeros there, so that whatever was reading sees
+// NULs instead of us dying. Anything else is left to kill us as usual.
+void onBusError(int, siginfo_t* info, void*) {
+  uintptr_t at = (uintptr_t) info->si_addr;
+  if (info->si_code == BUS_ADRERR) {
+    for (GuardedRange& range : guarded) {
+      uintptr_t begin = range.begin;
+      if (begin <= 1 || at < begin || at >= range.end) continue;
+      uintptr_t page = at & ~(uintptr_t) (pageSize - 1);
+      if (mmap((void*) page, pageSize, PROT_READ,
+          MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+        break;
+      range.cut = true;
       return;
     }
-    std::string curLine;
-    while (!fh.eof()) {
-      char c = fh.get();
-      if (c == '\n') {
-        addLineAtBack(curLine);
-        curLine = "";
-      }
-      else curLine += c;
-    }
   }
-  void readOptions() {
-    std::ifstream fh(getHome() + "/.veneplU_dat/options");
-    if (fh.fail()) return;
-    std::string s;
-    std::vector<std::string> invalidOptions;
-    while (getline(fh, s)) {
-      size_t firstNonspace = s.find_first_not_of(WHITESPACE);
-      if (firstNonspace == std::string::npos || s[firstNonspace] == '#')
-        continue;
-      // Get the parts
-      size_t split = s.find('=');
-      std::string key = trimWhitespace(s.substr(0, split));
-      std::string value = trimWhitespace(s.substr(split + 1));
-      auto it1 = boolOptionsByName.find(key);
-      if (it1 != boolOptionsByName.end()) {
-        size_t index = it1->second;
-        options.boolOptions[index] = isTruthy(value);
-      } else {
-        // invalid option
-        invalidOptions.push_back(key);
-        std::cout << key << '\n';
-        std::cin.get();
-      }
+  // Not ours to fix; the access happens again and takes us down.
+  signal(SIGBUS, SIG_DFL);
+}
+
+void guardMappings() {
+  pageSize = sysconf(_SC_PAGESIZE);
+  struct sigaction action = {};
+  action.sa_sigaction = onBusError;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGBUS, &action, nullptr);
+}
+
+// A file mapped read-only into memory, or a copy of one. Lines that have
+// not been edited point straight into it, so it has to outlive them.
+// Something else can write to a file while we have it mapped, which
+// changes the text under the lines, or even cut it short. So the buffer
+// only keeps lines that point into copies, whose memory is our own.
+// Mapping the file itself is left to things that only look at it.
+class MappedFile {
+public:
+  ~MappedFile() {
+    unguardRange(slot);
+    if (data != nullptr) munmap(const_cast<char*>(data), size);
+    if (fd >= 0) close(fd);
+  }
+  // Maps fname itself. Returns nullptr if the file could not be opened.
+  // Empty files are not mapped at all, but still succeed.
+  static std::shared_ptr<MappedFile> open(const char* fname) {
+    int fd = ::open(fname, O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      return nullptr;
     }
-    if (!invalidOptions.empty()) {
-      message = "";
-      for (const std::string opt : invalidOptions) {
-        message += '"';
-        message += opt;
-        message += "\" ";
+    std::shared_ptr<MappedFile> file(new MappedFile);
+    if (st.st_size > 0) {
+      void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        close(fd);
+        return nullptr;
       }
-      message += "turotenus kêl ";
-      message +=
-        (invalidOptions.size() == 1) ? "ase" :
-        (invalidOptions.size() == 2) ? "ases" : "ese";
-      message += '!';
-      messageColour = 9;
+      // We read it front to back once to find the line breaks.
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      file->data = (const char*) p;
+      file->size = st.st_size;
+      file->available = file->size;
+      file->slot = guardRange(file->data, file->size);
     }
+    close(fd);
+    return file;
   }
-  void draw() {
-    resizeIfNecessary();
-    // Clear entire screen and the scrollback buffer,
-    // and move the cursor to the top-left corner.
-    std::string output = CLEAR_EVERYTHING;
-    size_t rows = 0;
-    size_t lineno = scrollRow;
-    // Draw each line.
-    while (rows < height - 1) {
-      if (lineno >= lines.size()) {
-        drawBlank(output, lineno);
-        ++rows;
-      } else {
-        rows += drawLine(lines[lineno], output, lineno);
-      }
-      ++lineno;
+  // Sets aside memory for a copy of length bytes of fname from offset
+  // on, or as much of that as there is. Nothing is read until fill() is
+  // called. Returns nullptr if the file could not be opened.
+  static std::shared_ptr<MappedFile> copy(const char* fname,
+      size_t offset = 0, size_t length = SIZE_MAX) {
+    int fd = ::open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      return nullptr;
     }
-    if (message.empty()) {
-      // Info about the buffer.
-      output += "\x1b[32;1mveneplū\x1b[0m -";
-      if (filename != "") {
-        output += " \x1b[35;1m";
-        output += filename;
-        if (dirty)
-          output += "\x1b[31;1m*";
-      } else {
-        output += " \x1b[31;1m*";
-      }
-      output += " \x1b[36;1m";
-      output += toString(lines.size()) + " v";
-      output +=
-        (lines.size() == 1) ? 'a' : 'e';
-      output += "tál ";
-      output += toString(cursorRow + 1);
-      output +=
-        (cursorRow == 0) ? "ma" :
-        (cursorRow == 1) ? "mu" : "ru";
-      output += " | ";
-      output += toString(cursorVCol + 1);
-      output +=
-        (cursorVCol == 0) ? "ma" :
-        (cursorVCol == 1) ? "mu" : "ru";
-      output += " vżama";
-      if (isDHR) {
-        output += " \x1b[33;1mḊ[";
-        output += box.upper ? 'K' : 'k';
-        output +=
-          box.forceStress ? "ûú" :
-          box.forceUnstress ? "ūu" : "ûu";
-        output += "]";
-      }
-    } else {
-      drawMessage(output);
+    std::shared_ptr<MappedFile> file(new MappedFile);
+    offset = std::min<size_t>(offset, st.st_size);
+    length = std::min<size_t>(length, st.st_size - offset);
+    if (length == 0) {
+      close(fd);
+      return file;
     }
-    // Move cursor to correct position.
-    output += "\x1b[";
-    output += std::to_string(cursorRow - scrollRow + 1); // row
-    output += ";";
-    size_t horizontalOffset = options.lineno() ? 6 : 0;
-    output += std::to_string(std::min(cursorVCol, vlengths[cursorRow]) + 1 + horizontalOffset); // column
-    output += "H";
-    // Finally, actually render the damn thing.
-    write(0, output.c_str(), output.length());
+    void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      return nullptr;
+    }
+    file->data = (const char*) p;
+    file->size = length;
+    file->fd = fd;
+    file->offset = offset;
+    return file;
   }
-  void react(int keycode) {
-    if (!first) message = "";
-    else first = false;
-    if (isDHR && keycode >= 0) {
-      keycode = box.feed(keycode);
-      if (keycode <= 0) {
-        if (keycode == 0) std::cout << '\a';
-        keycode = SpecialKeys::UNKNOWN;
+  // Reads the copy in up to byte upTo, and returns how much of it is in.
+  // Only one thread at a time may call this.
+  size_t fill(size_t upTo) {
+    size_t at = available;
+    upTo = std::min(upTo, size);
+    char* p = const_cast<char*>(data);
+    while (at < upTo) {
+      ssize_t n = pread(fd, p + at, upTo - at, offset + at);
+      if (n < 0 && errno == EINTR) continue;
+      // If the file got shorter meanwhile, the rest is left as zeros.
+      if (n <= 0) {
+        at = size;
+        break;
       }
+      at += n;
     }
-    switch (keycode) {
-      case SpecialKeys::LEFT: left(); break;
-      case SpecialKeys::RIGHT: right(); break;
-      case SpecialKeys::UP: up(); break;
-      case SpecialKeys::DOWN: down(); break;
-      case SpecialKeys::BACKSPACE: backspace(); break;
-      case SpecialKeys::DELETE: del(); break;
-      case SpecialKeys::ENTER: insertNewLine(); break;
-      case SpecialKeys::SAVE: saveIntractive(); break;
-      case SpecialKeys::SAVE_AS: saveIntractive(true); break;
-      case SpecialKeys::DHR_MODE: isDHR = !isDHR; box.reset(); break;
-      case SpecialKeys::RESET: std::cout << '\a'; break;
-      case SpecialKeys::UNKNOWN: break;
-      default: insert(keycode);
+    available = at;
+    if (at == size && fd >= 0) {
+      close(fd);
+      fd = -1;
+      mprotect(p, size, PROT_READ);
     }
+    return at;
+  }
+  // How much of the copy has been read in
+  size_t ready() const {
+    return available;
+  }
+  bool contains(const char* p) const {
+    return p >= data && p < data + size;
+  }
+  // Has the file been cut short under a mapping of it, so that part of it
+  // now reads as NULs?
+  bool cut() const {
+    return slot < MAX_GUARDED && guarded[slot].cut;
   }
+  const char* data = nullptr;
+  size_t size = 0;
 private:
-  size_t actualWidth() const {
-    size_t xoff = 0;
-    if (prompting) xoff = message.length() + 2;
-    else if (options.lineno()) xoff = 6;
-    return width - xoff;
+  MappedFile() = default;
+  size_t slot = MAX_GUARDED;
+  // Where a copy is read in from, until it has all been
+  int fd = -1;
+  size_t offset = 0;
+  std::atomic<size_t> available{0};
+};
+
+// A line of text. Lines loaded from a file start out as views into the
+// mapping and only get their own copy once they are edited. Long lines
+// keep their copy in chunks, so that an edit only has to shift the
+// bytes of one chunk around instead of the whole line. Copies share
+// their text until one of them is edited.
+class Line {
+public:
+  Line() = default;
+  Line(const char* data, size_t length) : ptr(data), len(length) {}
+  Line(const std::string& s) : text(std::make_shared<std::string>(s)) {
+    sync();
+    if (len >= CHUNKED_MIN) toChunks();
   }
-  void left() {
-    auto& line = prompting ? promptInput : lines[cursorRow];
-    auto& vlength = prompting ? promptVLength : vlengths[cursorRow];
+  Line(std::string&& s) :
+      text(std::make_shared<std::string>(std::move(s))) {
+    sync();
+    if (len >= CHUNKED_MIN) toChunks();
+  }
+  // The column index is left behind; it is cheap to build again.
+  Line(const Line& other) :
+    ptr(other.ptr), len(other.len), text(other.text), chunks(other.chunks) {}
+  Line(Line&& other) = default;
+  Line& operator=(const Line& other) {
+    Line copy(other);
+    return *this = std::move(copy);
+  }
+  Line& operator=(Line&& other) = default;
+  size_t length() const {
+    return len;
+  }
+  bool empty() const {
+    return len == 0;
+  }
+  char operator[](size_t i) const {
+    if (chunks == nullptr) return ptr[i];
+    const Chunk& c = chunkAt(i);
+    return (*c.bytes)[i - c.start];
+  }
+  // The longest stretch of bytes starting at i that are stored together
+  std::pair<const char*, size_t> run(size_t i) const {
+    if (chunks == nullptr) return {ptr + i, len - i};
+    const Chunk& c = chunkAt(i);
+    return {c.bytes->data() + (i - c.start), c.bytes->length() - (i - c.start)};
+  }
+  // The n bytes starting at pos
+  std::string str(size_t pos, size_t n) const {
+    std::string s;
+    s.reserve(n);
+    while (n > 0) {
+      auto [p, m] = run(pos);
+      m = std::min(m, n);
+      s.append(p, m);
+      pos += m;
+      n -= m;
+    }
+    return s;
+  }
+  std::string str() const {
+    if (chunks == nullptr) return std::string(ptr, len);
+    std::string s;
+    s.reserve(len);
+    for (const Chunk& c : *chunks) s += *c.bytes;
+    return s;
+  }
+  // Where needle first shows up within [from, to), or std::string::npos
+  size_t find(const std::string& needle, size_t from = 0,
+      size_t to = std::string::npos) const {
+    to = std::min(to, len);
+    size_t m = needle.length();
+    if (m == 0) return from <= to ? from : std::string::npos;
+    size_t i = from;
+    while (i < to && to - i >= m) {
+      auto [p, n] = run(i);
+      n = std::min(n, to - i);
+      size_t at = findBytes(p, n, needle);
+      if (at != std::string::npos) return i + at;
+      if (i + n == to) break;
+      // It might straddle two chunks.
+      size_t back = std::min(n, m - 1);
+      std::string seam = str(i + n - back, back + std::min(m - 1, to - i - n));
+      at = findBytes(seam.data(), seam.length(), needle);
+      if (at != std::string::npos) return i + n - back + at;
+      i += n;
+    }
+    return std::string::npos;
+  }
+  bool isView() const {
+    return text == nullptr && chunks == nullptr;
+  }
+  Line substr(size_t pos) const {
+    Line tail;
+    while (pos < len) {
+      auto [p, n] = run(pos);
+      tail.replace(tail.len, 0, p, n);
+      pos += n;
+    }
+    return tail;
+  }
+  void insert(size_t pos, const std::string& s) {
+    replace(pos, 0, s.data(), s.length());
+  }
+  void erase(size_t pos, size_t n = std::string::npos) {
+    n = std::min(n, len - pos);
+    replace(pos, n, nullptr, 0);
+  }
+  void append(const Line& other) {
+    for (size_t i = 0; i < other.len;) {
+      auto [p, n] = other.run(i);
+      replace(len, 0, p, n);
+      i += n;
+    }
+  }
+  // Joining two long lines hands the chunks over instead of copying them.
+  void append(Line&& other) {
+    own();
+    if (chunks == nullptr || other.chunks == nullptr) {
+      append(other);
+      return;
+    }
+    for (const Chunk& c : *other.chunks)
+      chunks->push_back({c.start + len, c.bytes});
+    size_t oldLen = len;
+    len += other.len;
+    other.clear();
+    if (columns != nullptr) {
+      Checkpoint last = columns->back();
+      std::vector<Checkpoint> fresh;
+      // The old end is a codepoint boundary only if it starts one.
+      if (isContinuation((*this)[oldLen])) {
+        mark(last.byte, len, last.vcol, fresh);
+      } else {
+        fresh.push_back({oldLen, last.vcol + wcswidthp(*this, last.byte, oldLen)});
+        mark(oldLen, len, fresh.back().vcol, fresh);
+      }
+      columns->insert(columns->end(), fresh.begin(), fresh.end());
+    }
+  }
+  void clear() {
+    text.reset();
+    chunks.reset();
+    columns.reset();
+    ptr = nullptr;
+    len = 0;
+  }
+  // Take a copy of the text if this is still a view, or if another
+  // line shares it.
+  void own() {
+    if (isView()) {
+      text = len == 0 ? std::make_shared<std::string>() :
+        std::make_shared<std::string>(ptr, len);
+      sync();
+      if (len >= CHUNKED_MIN) toChunks();
+    } else if (text != nullptr && text.use_count() > 1) {
+      text = std::make_shared<std::string>(*text);
+      sync();
+    } else if (chunks != nullptr && chunks.use_count() > 1) {
+      // The chunks themselves never change, so they can stay shared.
+      chunks = std::make_shared<std::vector<Chunk>>(*chunks);
+    }
+  }
+  // The visual column at byte pos, which has to start a codepoint
+  size_t columnOf(size_t pos) const {
+    if (len < COLUMN_INDEX_MIN) return wcswidthp(*this, pos);
+    const auto& cps = index();
+    auto it = std::upper_bound(cps.begin(), cps.end(), pos,
+      [](size_t p, const Checkpoint& c) { return p < c.byte; });
+    --it;
+    return it->vcol + wcswidthp(*this, it->byte, pos);
+  }
+  // The first byte at which the line is at least vcol columns wide
+  size_t byteAtColumn(size_t vcol) const {
+    if (len < COLUMN_INDEX_MIN) return unwcswidthp(*this, vcol);
+    if (vcol == 0) return 0;
+    // Start from the last checkpoint short of vcol, since anything
+    // zero-width right before a checkpoint could be the answer.
+    const auto& cps = index();
+    auto it = std::lower_bound(cps.begin(), cps.end(), vcol,
+      [](const Checkpoint& c, size_t v) { return c.vcol < v; });
+    --it;
+    return unwcswidthp(*this, vcol - it->vcol, it->byte);
+  }
+private:
+  // Lines this long are kept in chunks of at most CHUNK_MAX bytes,
+  // and go back to one string once they are shorter than a chunk.
+  static constexpr size_t CHUNKED_MIN = 262144;
+  static constexpr size_t CHUNK_MAX = 65536;
+  static constexpr size_t CHUNK_FILL = 32768;
+  static constexpr size_t CHUNK_MIN = 8192;
+  struct Chunk {
+    size_t start;
+    std::shared_ptr<const std::string> bytes;
+  };
+  // Long lines remember their visual column every so often, so that
+  // moving up and down through them does not mean measuring everything
+  // before the cursor. Checkpoints only go on bytes that are not UTF-8
+  // continuations, which start a codepoint however the text before them
+  // is decoded.
+  static constexpr size_t COLUMN_INDEX_MIN = 65536;
+  static constexpr size_t COLUMN_STEP = 4096;
+  struct Checkpoint {
+    size_t byte;
+    size_t vcol;
+  };
+  void sync() {
+    ptr = text->data();
+    len = text->length();
+  }
+  // The chunk holding byte i, or the last one for the end of the line
+  size_t chunkIndex(size_t i) const {
+    const auto& cs = *chunks;
+    return std::upper_bound(cs.begin(), cs.end(), i,
+      [](size_t j, const Chunk& c) { return j < c.start; }) - cs.begin() - 1;
+  }
+  const Chunk& chunkAt(size_t i) const {
+    return (*chunks)[chunkIndex(i)];
+  }
+  // Cuts n bytes into chunks that start at byte start of the line.
+  static void cut(const char* p, size_t n, size_t start,
+      std::vector<Chunk>& out) {
+    while (n > 0) {
+      size_t m = n > CHUNK_MAX ? CHUNK_FILL : n;
+      out.push_back({start, std::make_shared<const std::string>(p, m)});
+      p += m;
+      n -= m;
+      start += m;
+    }
+  }
+  void toChunks() {
+    chunks = std::make_shared<std::vector<Chunk>>();
+    chunks->reserve(len / CHUNK_FILL + 1);
+    cut(text->data(), len, 0, *chunks);
+    text.reset();
+    ptr = nullptr;
+  }
+  void fromChunks() {
+    text = std::make_shared<std::string>(str());
+    chunks.reset();
+    sync();
+  }
+  // Replaces n bytes at pos with the m bytes at p. Only the chunks that
+  // the edit touches are cut again.
+  void splice(size_t pos, size_t n, const char* p, size_t m) {
+    if (chunks == nullptr) {
+      text->replace(pos, n, p, m);
+      sync();
+      if (len >= CHUNKED_MIN) toChunks();
+      return;
+    }
+    auto& cs = *chunks;
+    size_t a = chunkIndex(pos);
+    size_t b = chunkIndex(pos + n);
+    std::string joined = cs[a].bytes->substr(0, pos - cs[a].start);
+    joined.append(p, m);
+    joined.append(*cs[b].bytes, pos + n - cs[b].start, std::string::npos);
+    // Rather than leave a scrap of a chunk, take a neighbour in with it.
+    if (joined.length() < CHUNK_MIN && b - a + 1 < cs.size()) {
+      if (b + 1 < cs.size()) {
+        joined += *cs[++b].bytes;
+      } else {
+        joined.insert(0, *cs[--a].bytes);
+      }
+    }
+    std::vector<Chunk> fresh;
+    cut(joined.data(), joined.length(), cs[a].start, fresh);
+    cs.erase(cs.begin() + a, cs.begin() + b + 1);
+    cs.insert(cs.begin() + a, fresh.begin(), fresh.end());
+    for (size_t i = a + fresh.size(); i < cs.size(); ++i)
+      cs[i].start += m - n;
+    len += m - n;
+    if (len < CHUNK_MAX) fromChunks();
+  }
+  // Adds checkpoints in (from, to) to out, given that from is at column
+  // vcol. Returns the column at to.
+  size_t mark(size_t from, size_t to, size_t vcol,
+      std::vector<Checkpoint>& out) const {
+    size_t pos = from;
+    while (true) {
+      size_t next = pos + COLUMN_STEP;
+      while (next < to && isContinuation((*this)[next])) ++next;
+      if (next >= to) break;
+      vcol += wcswidthp(*this, pos, next);
+      out.push_back({next, vcol});
+      pos = next;
+    }
+    return vcol + wcswidthp(*this, pos, to);
+  }
+  const std::vector<Checkpoint>& index() const {
+    if (columns == nullptr) {
+      columns.reset(new std::vector<Checkpoint>{{0, 0}});
+      mark(0, len, 0, *columns);
+    }
+    return *columns;
+  }
+  // Replaces n bytes at pos with the m bytes at p, and keeps the column
+  // index in step if there is one. Checkpoints in the edited stretch
+  // are put down again and the ones after it are shifted over, so only
+  // the text between their neighbours gets measured.
+  void replace(size_t pos, size_t n, const char* p, size_t m) {
+    own();
+    if (columns == nullptr) {
+      splice(pos, n, p, m);
+      return;
+    }
+    auto& cps = *columns;
+    // The last checkpoint before pos keeps its place. The byte at pos
+    // itself might end up a continuation.
+    size_t j = std::lower_bound(cps.begin(), cps.end(), pos,
+      [](const Checkpoint& c, size_t q) { return c.byte < q; }) - cps.begin();
+    if (j > 0) --j;
+    size_t k = std::lower_bound(cps.begin(), cps.end(), pos + n,
+      [](const Checkpoint& c, size_t q) { return c.byte < q; }) - cps.begin();
+    k = std::max(k, j + 1);
+    size_t from = cps[j].byte;
+    size_t to = k < cps.size() ? cps[k].byte : len;
+    size_t oldWidth = wcswidthp(*this, from, to);
+    splice(pos, n, p, m);
+    std::vector<Checkpoint> fresh;
+    size_t newWidth =
+      mark(from, to + m - n, cps[j].vcol, fresh) - cps[j].vcol;
+    for (size_t i = k; i < cps.size(); ++i) {
+      cps[i].byte += m - n;
+      cps[i].vcol += newWidth - oldWidth;
+    }
+    cps.erase(cps.begin() + j + 1, cps.begin() + k);
+    cps.insert(cps.begin() + j + 1, fresh.begin(), fresh.end());
+    if (len < COLUMN_INDEX_MIN) columns.reset();
+  }
+  // Points to the text when it is all in one place, whether it is ours
+  // or not.
+  const char* ptr = nullptr;
+  size_t len = 0;
+  std::shared_ptr<std::string> text;
+  std::shared_ptr<std::vector<Chunk>> chunks;
+  mutable std::unique_ptr<std::vector<Checkpoint>> columns;
+};
+
+std::pair<const char*, size_t> textRun(const Line& s, size_t i) {
+  return s.run(i);
+}
+
+// The document is kept as a treap of leaves, each of which holds a run of
+// consecutive lines. Every node knows how many lines are in its subtree,
+// so that finding line i, or inserting or erasing a line there, costs
+// O(log n) instead of shifting the rest of a vector around.
+// Copying a tree is cheap: the copy shares every node with the
+// original, and whichever of them changes a node first gets its own
+// copy of it, along with the path down to it.
+class LineTree {
+public:
+  struct Entry {
+    Line text;
+    size_t vlength;
+  };
+  size_t size() const {
+    return count(root.get());
+  }
+  bool empty() const {
+    return root == nullptr;
+  }
+  Line& operator[](size_t i) {
+    return at(i).text;
+  }
+  const Line& operator[](size_t i) const {
+    return at(i).text;
+  }
+  size_t& vlength(size_t i) {
+    return at(i).vlength;
+  }
+  size_t vlength(size_t i) const {
+    return at(i).vlength;
+  }
+  void clear() {
+    root.reset();
+  }
+  void insert(size_t i, Line text, size_t vlength) {
+    if (root == nullptr) {
+      root = makeNode({});
+    }
+    // Find the leaf to put the line in. Inserting at the very end
+    // goes into the last leaf.
+    std::vector<NodePtr*> path;
+    NodePtr* link = &root;
+    size_t leafStart = 0;
+    while (true) {
+      Node* n = unshare(*link);
+      path.push_back(link);
+      size_t lc = count(n->left.get());
+      if (i < lc) {
+        link = &n->left;
+      } else if (i <= lc + n->items.size()) {
+        leafStart += lc;
+        i -= lc;
+        break;
+      } else {
+        leafStart += lc + n->items.size();
+        i -= lc + n->items.size();
+        link = &n->right;
+      }
+    }
+    Node* leaf = link->get();
+    leaf->items.insert(leaf->items.begin() + i,
+      Entry{std::move(text), vlength});
+    for (NodePtr* p : path) ++(*p)->count;
+    if (leaf->items.size() > LEAF_MAX) {
+      // Break the leaf in two. Splitting in the middle of a leaf does
+      // exactly that; merging again puts the halves back in the tree.
+      auto [a, b] = split(std::move(root), leafStart + leaf->items.size() / 2);
+      root = merge(std::move(a), std::move(b));
+    }
+  }
+  void push_back(Line text, size_t vlength) {
+    insert(size(), std::move(text), vlength);
+  }
+  // Inserts a batch of lines before line i in one go.
+  void insert(size_t i, std::vector<Entry>&& entries) {
+    if (entries.empty()) return;
+    NodePtr middle;
+    for (size_t j = 0; j < entries.size(); j += LEAF_FILL) {
+      NodePtr leaf = makeNode({});
+      size_t end = std::min(entries.size(), j + LEAF_FILL);
+      leaf->items.reserve(end - j);
+      for (size_t k = j; k < end; ++k)
+        leaf->items.push_back(std::move(entries[k]));
+      update(leaf.get());
+      middle = merge(std::move(middle), std::move(leaf));
+    }
+    auto [a, b] = split(std::move(root), i);
+    root = merge(merge(std::move(a), std::move(middle)), std::move(b));
+  }
+  void erase(size_t i) {
+    std::vector<NodePtr*> path;
+    NodePtr* link = &root;
+    while (true) {
+      Node* n = unshare(*link);
+      path.push_back(link);
+      size_t lc = count(n->left.get());
+      if (i < lc) {
+        link = &n->left;
+      } else if (i < lc + n->items.size()) {
+        i -= lc;
+        break;
+      } else {
+        i -= lc + n->items.size();
+        link = &n->right;
+      }
+    }
+    Node* leaf = link->get();
+    leaf->items.erase(leaf->items.begin() + i);
+    for (NodePtr* p : path) --(*p)->count;
+    if (leaf->items.empty()) {
+      // Nothing left in this leaf; splice its children together
+      // in its place.
+      *link = merge(std::move(leaf->left), std::move(leaf->right));
+    }
+  }
+  // Erases lines [i, j).
+  void erase(size_t i, size_t j) {
+    if (i >= j) return;
+    auto [a, rest] = split(std::move(root), i);
+    auto [middle, b] = split(std::move(rest), j - i);
+    root = merge(std::move(a), std::move(b));
+  }
+  // Calls f on every line in order.
+  template<typename F>
+  void forEach(F f) const {
+    forEach(root.get(), f);
+  }
+  // Calls f(k, entry) on the line at rows[k] for each k, where rows are
+  // in order. Only the parts of the tree those lines are in get copied
+  // if they are shared.
+  template<typename F>
+  void update(const std::vector<size_t>& rows, F f) {
+    update(root, rows.begin(), rows.end(), rows.begin(), 0, f);
+  }
+  // Calls f(row, line) on every line from row i on, in order, until it
+  // returns false. Returns false if it was stopped that way.
+  template<typename F>
+  bool forEachFrom(size_t i, F f) const {
+    return forEachFrom(root.get(), i, 0, f);
+  }
+private:
+  struct Node;
+  using NodePtr = std::shared_ptr<Node>;
+  struct Node {
+    std::vector<Entry> items;
+    NodePtr left, right;
+    size_t count = 0;
+    uint32_t priority;
+  };
+  // Leaves are split once they get larger than LEAF_MAX lines;
+  // batches are cut into leaves of LEAF_FILL lines.
+  static constexpr size_t LEAF_MAX = 512;
+  static constexpr size_t LEAF_FILL = 256;
+  NodePtr root;
+  uint32_t seed = 0x9E3779B9;
+  uint32_t nextPriority() {
+    // xorshift32 is plenty for treap priorities
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+  }
+  NodePtr makeNode(std::vector<Entry>&& items) {
+    NodePtr n = std::make_shared<Node>();
+    n->items = std::move(items);
+    n->priority = nextPriority();
+    update(n.get());
+    return n;
+  }
+  static size_t count(const Node* n) {
+    return n == nullptr ? 0 : n->count;
+  }
+  static void update(Node* n) {
+    n->count = count(n->left.get()) + n->items.size() + count(n->right.get());
+  }
+  // Gives back a node that nothing else shares, so it can be changed.
+  static Node* unshare(NodePtr& n) {
+    if (n.use_count() > 1) n = std::make_shared<Node>(*n);
+    return n.get();
+  }
+  Entry& at(size_t i) {
+    NodePtr* link = &root;
+    while (true) {
+      Node* n = unshare(*link);
+      size_t lc = count(n->left.get());
+      if (i < lc) {
+        link = &n->left;
+      } else if (i < lc + n->items.size()) {
+        return n->items[i - lc];
+      } else {
+        i -= lc + n->items.size();
+        link = &n->right;
+      }
+    }
+  }
+  const Entry& at(size_t i) const {
+    const Node* n = root.get();
+    while (true) {
+      size_t lc = count(n->left.get());
+      if (i < lc) {
+        n = n->left.get();
+      } else if (i < lc + n->items.size()) {
+        return n->items[i - lc];
+      } else {
+        i -= lc + n->items.size();
+        n = n->right.get();
+      }
+    }
+  }
+  NodePtr merge(NodePtr a, NodePtr b) {
+    if (a == nullptr) return b;
+    if (b == nullptr) return a;
+    if (a->priority > b->priority) {
+      unshare(a);
+      a->right = merge(std::move(a->right), std::move(b));
+      update(a.get());
+      return a;
+    } else {
+      unshare(b);
+      b->left = merge(std::move(a), std::move(b->left));
+      update(b.get());
+      return b;
+    }
+  }
+  // Splits t into its first k lines and the rest.
+  // If the cut falls inside a leaf, the leaf is cut in two as well.
+  std::pair<NodePtr, NodePtr> split(NodePtr t, size_t k) {
+    if (t == nullptr) return {nullptr, nullptr};
+    unshare(t);
+    size_t lc = count(t->left.get());
+    if (k <= lc) {
+      auto [a, b] = split(std::move(t->left), k);
+      t->left = std::move(b);
+      update(t.get());
+      return {std::move(a), std::move(t)};
+    }
+    if (k >= lc + t->items.size()) {
+      auto [a, b] = split(std::move(t->right), k - lc - t->items.size());
+      t->right = std::move(a);
+      update(t.get());
+      return {std::move(t), std::move(b)};
+    }
+    size_t offset = k - lc;
+    std::vector<Entry> tailItems(
+      std::make_move_iterator(t->items.begin() + offset),
+      std::make_move_iterator(t->items.end()));
+    t->items.resize(offset);
+    NodePtr right = std::move(t->right);
+    update(t.get());
+    NodePtr tail = makeNode(std::move(tailItems));
+    return {std::move(t), merge(std::move(tail), std::move(right))};
+  }
+  template<typename F>
+  static void forEach(const Node* n, F& f) {
+    if (n == nullptr) return;
+    forEach(n->left.get(), f);
+    for (const auto& e : n->items) f(e.text);
+    forEach(n->right.get(), f);
+  }
+  // base is the row of the first line under n.
+  template<typename It, typename F>
+  static void update(NodePtr& n, It first, It last, It begin, size_t base,
+      F& f) {
+    if (first == last) return;
+    Node* node = unshare(n);
+    size_t leftCount = count(node->left.get());
+    It mid = std::lower_bound(first, last, base + leftCount);
+    update(node->left, first, mid, begin, base, f);
+    base += leftCount;
+    It end = std::lower_bound(mid, last, base + node->items.size());
+    for (It it = mid; it != end; ++it)
+      f(it - begin, node->items[*it - base]);
+    update(node->right, end, last, begin, base + node->items.size(), f);
+  }
+  template<typename F>
+  static bool forEachFrom(const Node* n, size_t i, size_t base, F& f) {
+    if (n == nullptr) return true;
+    size_t leftCount = count(n->left.get());
+    if (i < base + leftCount && !forEachFrom(n->left.get(), i, base, f))
+      return false;
+    base += leftCount;
+    for (size_t k = i > base ? i - base : 0; k < n->items.size(); ++k) {
+      if (!f(base + k, n->items[k].text)) return false;
+    }
+    return forEachFrom(n->right.get(), i, base + n->items.size(), f);
+  }
+};
+
+// What a cell on the screen looks like apart from its text.
+// The low byte is the foreground colour; the rest are flags.
+enum CellAttr : uint32_t {
+  A_PLAIN = 0,
+  A_FG = 0x100,
+  A_BOLD = 0x200,
+  A_REVERSE = 0x400,
+};
+constexpr uint32_t colour(int c) {
+  return A_FG | c;
+}
+// The attributes for one of our 4-bit message colours
+constexpr uint32_t messageAttr(int c) {
+  return colour(c & 7) | ((c & 8) != 0 ? A_BOLD : 0);
+}
+
+struct Cell {
+  // Whatever goes in this cell, as UTF-8. The right half of a wide
+  // character is empty, since the left half covers it.
+  std::string text = " ";
+  uint32_t attr = A_PLAIN;
+  bool operator==(const Cell& other) const {
+    return attr == other.attr && text == other.text;
+  }
+  bool operator!=(const Cell& other) const {
+    return !(*this == other);
+  }
+};
+
+// Remembers what is on the terminal so that a frame only has to send
+// the cells that changed since the one before.
+class Screen {
+public:
+  size_t width = 0, height = 0;
+  void resize(size_t w, size_t h) {
+    width = w;
+    height = h;
+    next.assign(height, std::vector<Cell>(width));
+    invalidate();
+  }
+  // Forget what is on the terminal, so the next frame is sent in full.
+  void invalidate() {
+    shown.clear();
+  }
+  // Tells the next render that rows top to bottom have moved up by delta
+  // rows (or down, if it is negative). If that is mostly the case, the
+  // terminal is told to scroll them, and only the rows that come into view
+  // have to be sent.
+  void scroll(size_t top, size_t bottom, long delta) {
+    scrollTop = top;
+    scrollBottom = bottom;
+    scrollDelta = delta;
+  }
+  // Starts a new frame with every cell blank.
+  void clear() {
+    for (auto& row : next) std::fill(row.begin(), row.end(), Cell());
+  }
+  // Puts something w columns wide at (row, col), unless it would not fit.
+  // Returns the column after it.
+  size_t put(size_t row, size_t col, const char* text, size_t len,
+      size_t w, uint32_t attr) {
+    if (row >= height) return col;
+    if (w == 0) {
+      // Combining characters go with whatever came before them.
+      if (col > 0 && col <= width) next[row][col - 1].text.append(text, len);
+      return col;
+    }
+    if (col + w > width) return col + w;
+    next[row][col] = Cell{std::string(text, len), attr};
+    for (size_t i = 1; i < w; ++i) next[row][col + i] = Cell{"", attr};
+    return col + w;
+  }
+  // Writes a string of printable text starting at (row, col).
+  size_t print(size_t row, size_t col, const std::string& s,
+      uint32_t attr = A_PLAIN) {
+    UTF8Iterator<const std::string> it(s), end(s, true);
+    while (it != end) {
+      size_t oldPosition = it.position();
+      int codepoint = it.getAndAdvance();
+      col = put(row, col, s.data() + oldPosition, it.position() - oldPosition,
+        wcwidthp(codepoint), attr);
+    }
+    return col;
+  }
+  // Appends to output whatever it takes to turn the last frame into this
+  // one, then puts the cursor at (cursorRow, cursorCol).
+  void render(std::string& output, size_t cursorRow, size_t cursorCol) {
+    if (shown.size() != height) {
+      // We don't know what is on the screen, so start from scratch.
+      // Unlike CLEAR_EVERYTHING, this leaves the scrollback alone.
+      output += "\x1b[0m\x1b[2J";
+      shown.assign(height, std::vector<Cell>(width));
+    } else if (scrollDelta != 0) {
+      scrollRegion(output);
+    }
+    scrollDelta = 0;
+    const Cell blank;
+    uint32_t current = A_PLAIN;
+    for (size_t r = 0; r < height; ++r) {
+      const std::vector<Cell>& old = shown[r];
+      const std::vector<Cell>& row = next[r];
+      // Find the span of cells that changed.
+      size_t first = 0;
+      while (first < width && old[first] == row[first]) ++first;
+      if (first == width) continue;
+      size_t last = width;
+      while (last > first && old[last - 1] == row[last - 1]) --last;
+      // Don't start in the middle of a wide character.
+      while (first > 0 && row[first].text.empty()) --first;
+      // If everything to the right is blank, erase it in one go.
+      size_t contentEnd = width;
+      while (contentEnd > 0 && row[contentEnd - 1] == blank) --contentEnd;
+      bool eraseRest = last > contentEnd;
+      if (eraseRest) last = contentEnd;
+      moveCursor(output, r, first);
+      for (size_t c = first; c < last; ++c) {
+        if (row[c].attr != current) {
+          current = row[c].attr;
+          setAttr(output, current);
+        }
+        output += row[c].text;
+      }
+      if (eraseRest) {
+        if (current != A_PLAIN) {
+          current = A_PLAIN;
+          output += "\x1b[0m";
+        }
+        output += "\x1b[K";
+      }
+    }
+    if (current != A_PLAIN) output += "\x1b[0m";
+    moveCursor(output, cursorRow, cursorCol);
+    // The old frame's rows get wiped before the next one is drawn.
+    shown.swap(next);
+  }
+private:
+  void scrollRegion(std::string& output) {
+    if (scrollBottom >= height || scrollTop > scrollBottom) return;
+    size_t rows = scrollBottom - scrollTop + 1;
+    size_t distance = scrollDelta < 0 ? -scrollDelta : scrollDelta;
+    if (distance >= rows) return;
+    // Only bother if more rows line up after scrolling than before.
+    size_t same = 0, shifted = 0;
+    for (size_t r = scrollTop; r <= scrollBottom; ++r) {
+      if (next[r] == shown[r]) ++same;
+      long from = (long) r + scrollDelta;
+      if (from >= (long) scrollTop && from <= (long) scrollBottom &&
+          next[r] == shown[from])
+        ++shifted;
+    }
+    if (shifted <= same) return;
+    // Set the scroll region, scroll it with SU or SD, then reset it.
+    output += "\x1b[";
+    output += std::to_string(scrollTop + 1);
+    output += ';';
+    output += std::to_string(scrollBottom + 1);
+    output += "r\x1b[";
+    output += std::to_string(distance);
+    output += scrollDelta > 0 ? 'S' : 'T';
+    output += "\x1b[r";
+    // The terminal now shows the rows shifted, with blanks coming in.
+    auto begin = shown.begin() + scrollTop;
+    auto end = shown.begin() + scrollBottom + 1;
+    if (scrollDelta > 0) {
+      std::rotate(begin, begin + distance, end);
+      std::fill(end - distance, end, std::vector<Cell>(width));
+    } else {
+      std::rotate(begin, end - distance, end);
+      std::fill(begin, begin + distance, std::vector<Cell>(width));
+    }
+  }
+  static void moveCursor(std::string& output, size_t row, size_t col) {
+    output += "\x1b[";
+    output += std::to_string(row + 1);
+    output += ';';
+    output += std::to_string(col + 1);
+    output += 'H';
+  }
+  static void setAttr(std::string& output, uint32_t attr) {
+    output += "\x1b[0";
+    if ((attr & A_BOLD) != 0) output += ";1";
+    if ((attr & A_REVERSE) != 0) output += ";7";
+    if ((attr & A_FG) != 0) {
+      int c = attr & 0xFF;
+      if (c < 8) {
+        output += ";3";
+        output += (char) ('0' + c);
+      } else {
+        output += ";38;5;";
+        output += std::to_string(c);
+      }
+    }
+    output += 'm';
+  }
+  std::vector<std::vector<Cell>> next, shown;
+  size_t scrollTop = 0, scrollBottom = 0;
+  long scrollDelta = 0;
+};
+
+// Options
+
+enum BoolOptions {
+  B_LINE_NUMBERS = 0,
+  B_STATS,
+  // Says everything on the status line in English; see messageTexts
+  B_ENGLISH,
+  // add new ones before this line
+  B_COUNT
+};
+const std::unordered_map<std::string, size_t> boolOptionsByName = {
+  {"vatarika", 0},
+  {"stats", 1},
+  {"english", 2},
+};
+enum SizeOptions {
+  S_UNDO_MEMORY = 0,
+  S_VIEW_THRESHOLD,
+  // add new ones before this line
+  S_COUNT
+};
+const std::unordered_map<std::string, size_t> sizeOptionsByName = {
+  {"undo_memory", 0},
+  {"view_threshold", 1},
+};
+const size_t sizeOptionDefaults[S_COUNT] = {
+  64 << 20,
+  (size_t) 1 << 30,
+};
+
+// One change to the text: at (row, col), removed was taken out and
+// inserted was put in its place. Either can span several lines, which
+// are joined with '\n'.
+struct Edit {
+  enum Kind {
+    OTHER,
+    TYPING,
+    BACKSPACE,
+    DELETE,
+  };
+  size_t row, col;
+  std::string removed, inserted;
+  Kind kind = OTHER;
+  // Did the change start by adding a line after the last one?
+  bool newRow = false;
+  // Edits that are made and undone together, in the order they are made
+  std::vector<Edit> parts;
+  size_t memory() const {
+    size_t sum = sizeof(Edit) + removed.capacity() + inserted.capacity();
+    for (const Edit& part : parts) sum += part.memory();
+    return sum;
+  }
+};
+
+// The edits that can be undone and redone. Only what changed is kept,
+// so undoing something costs as much as the change did. The oldest
+// edits are forgotten once they take up more than limit bytes.
+class UndoLog {
+public:
+  void setLimit(size_t bytes) {
+    limit = bytes;
+    trim();
+  }
+  // Records an edit, folding it into the last one if it carries on
+  // from where that left off.
+  void record(Edit&& e) {
+    for (const Edit& u : undone) used -= u.memory();
+    undone.clear();
+    if (!sealed && !done.empty() && extend(done.back(), e)) return;
+    sealed = false;
+    used += e.memory();
+    done.push_back(std::move(e));
+    trim();
+  }
+  // Forgets everything, for when the text changed under us.
+  void clear() {
+    done.clear();
+    undone.clear();
+    used = 0;
+    sealed = false;
+  }
+  // Keeps the next edit from being folded into the last one.
+  void seal() {
+    sealed = true;
+  }
+  // Returns the edit to revert, or nullptr if there is none.
+  const Edit* undo() {
+    if (done.empty()) return nullptr;
+    undone.push_back(std::move(done.back()));
+    done.pop_back();
+    sealed = true;
+    return &undone.back();
+  }
+  // Returns the edit to make again, or nullptr if there is none.
+  const Edit* redo() {
+    if (undone.empty()) return nullptr;
+    done.push_back(std::move(undone.back()));
+    undone.pop_back();
+    sealed = true;
+    return &done.back();
+  }
+private:
+  // Where text ends up if it starts at (row, col)
+  static std::pair<size_t, size_t> endOf(size_t row, size_t col,
+      const std::string& text) {
+    size_t lastBreak = text.rfind('\n');
+    if (lastBreak == std::string::npos) return {row, col + text.length()};
+    return {row + std::count(text.begin(), text.end(), '\n'),
+      text.length() - lastBreak - 1};
+  }
+  bool extend(Edit& last, const Edit& e) {
+    if (e.kind != last.kind || e.newRow) return false;
+    std::pair<size_t, size_t> start(e.row, e.col);
+    std::pair<size_t, size_t> lastStart(last.row, last.col);
+    size_t before = last.memory();
+    switch (e.kind) {
+      case Edit::TYPING:
+        if (start != endOf(last.row, last.col, last.inserted)) return false;
+        last.inserted += e.inserted;
+        break;
+      case Edit::BACKSPACE:
+        if (endOf(e.row, e.col, e.removed) != lastStart) return false;
+        last.row = e.row;
+        last.col = e.col;
+        last.removed.insert(0, e.removed);
+        break;
+      case Edit::DELETE:
+        if (start != lastStart) return false;
+        last.removed += e.removed;
+        break;
+      default:
+        return false;
+    }
+    used += last.memory() - before;
+    trim();
+    return true;
+  }
+  void trim() {
+    while (used > limit && !done.empty()) {
+      used -= done.front().memory();
+      done.pop_front();
+    }
+  }
+  std::deque<Edit> done;
+  std::vector<Edit> undone;
+  size_t used = 0;
+  size_t limit = sizeOptionDefaults[S_UNDO_MEMORY];
+  bool sealed = false;
+};
+
+// How many lines to gather before splicing them into the tree
+constexpr size_t LOAD_BATCH = 65536;
+
+// Splits [p, end) into lines, stopping after maxLines of them.
+// Returns where it stopped.
+const char* indexLines(const char* p, const char* end, size_t maxLines,
+    std::vector<LineTree::Entry>& out) {
+  while (p < end && maxLines > 0) {
+    const char* nl = (const char*) memchr(p, '\n', end - p);
+    // The last line might not have a newline after it.
+    if (nl == nullptr) nl = end;
+    Line line(p, nl - p);
+    size_t vlength = wcswidthp(line);
+    out.push_back({std::move(line), vlength});
+    p = (nl == end) ? end : nl + 1;
+    --maxLines;
+  }
+  return p;
+}
+
+// Splits [p, end), read from a stream, into lines. The unfinished last
+// line is carried over in partial to go with the next bytes read.
+void splitStream(const char* p, const char* end, std::string& partial,
+    std::vector<LineTree::Entry>& out) {
+  while (p < end) {
+    const char* nl = (const char*) memchr(p, '\n', end - p);
+    if (nl == nullptr) {
+      partial.append(p, end);
+      return;
+    }
+    partial.append(p, nl);
+    Line line(std::move(partial));
+    partial = std::string();
+    size_t vlength = wcswidthp(line);
+    out.push_back({std::move(line), vlength});
+    p = nl + 1;
+  }
+}
+
+// Where the line that byte at of fd is in starts, or SIZE_MAX if the
+// file could not be read
+size_t lineStart(int fd, size_t at) {
+  char block[4096];
+  while (at > 0) {
+    size_t n = std::min(at, sizeof(block));
+    if (pread(fd, block, n, at - n) != (ssize_t) n) return SIZE_MAX;
+    const char* nl = (const char*) memrchr(block, '\n', n);
+    if (nl != nullptr) return at - n + (nl - block) + 1;
+    at -= n;
+  }
+  return 0;
+}
+
+// Where the first newline in [from, to) of fd is, or SIZE_MAX if there
+// is none
+size_t nextNewline(int fd, size_t from, size_t to) {
+  char block[4096];
+  while (from < to) {
+    size_t n = std::min(to - from, sizeof(block));
+    if (pread(fd, block, n, from) != (ssize_t) n) return SIZE_MAX;
+    const char* nl = (const char*) memchr(block, '\n', n);
+    if (nl != nullptr) return from + (nl - block);
+    from += n;
+  }
+  return SIZE_MAX;
+}
+
+// Gathers buffers to write to a file and writes them out with writev()
+// a batch at a time. Buffers that pick up right where the last one
+// left off are joined into one, so runs of unedited lines from the
+// mapped file go out in as few pieces as they came in.
+class GatherWriter {
+public:
+  GatherWriter(int fd) : fd(fd) {}
+  bool add(const char* p, size_t n) {
+    if (n == 0) return true;
+    if (!iov.empty() &&
+        (const char*) iov.back().iov_base + iov.back().iov_len == p) {
+      iov.back().iov_len += n;
+      return true;
+    }
+    if (iov.size() == IOV_MAX && !flush()) return false;
+    iov.push_back({const_cast<char*>(p), n});
+    return true;
+  }
+  // Writes out everything gathered so far, however many calls it takes.
+  bool flush() {
+    size_t i = 0;
+    while (i < iov.size()) {
+      ssize_t written = writev(fd, &iov[i], iov.size() - i);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      size_t w = written;
+      while (i < iov.size() && w >= iov[i].iov_len) {
+        w -= iov[i].iov_len;
+        ++i;
+      }
+      if (w > 0) {
+        iov[i].iov_base = (char*) iov[i].iov_base + w;
+        iov[i].iov_len -= w;
+      }
+    }
+    iov.clear();
+    return true;
+  }
+private:
+  int fd;
+  std::vector<struct iovec> iov;
+};
+
+// Reads in and indexes the rest of a copied file on a background thread
+// so that the first screen can be shown right away. The lines are handed
+// over in batches through take().
+class LineLoader {
+public:
+  LineLoader(std::shared_ptr<MappedFile> file, size_t start) :
+    file(file), scanned(start),
+    worker(&LineLoader::run, this) {}
+  // Reads lines from fd, which can be a pipe, until it runs out.
+  explicit LineLoader(int fd) :
+    fd(fd), scanned(0),
+    worker(&LineLoader::run, this) {}
+  ~LineLoader() {
+    cancelled = true;
+    wait();
+  }
+  // Moves the batches that are ready into out.
+  // Returns true once everything has been handed over.
+  bool take(std::vector<std::vector<LineTree::Entry>>& out) {
+    bool wasFinished = finished;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& batch : ready) out.push_back(std::move(batch));
+    ready.clear();
+    return wasFinished;
+  }
+  void wait() {
+    if (worker.joinable()) worker.join();
+  }
+  bool stream() const {
+    return file == nullptr;
+  }
+  // How far into the file we are, in per mille, or SIZE_MAX for a
+  // stream, whose length we don't know
+  size_t progress() const {
+    if (file == nullptr) return SIZE_MAX;
+    return file->size == 0 ? 1000 : scanned * 1000 / file->size;
+  }
+private:
+  void run() {
+    if (file == nullptr) {
+      readStream();
+      return;
+    }
+    const char* begin = file->data;
+    while (scanned < file->size && !cancelled) {
+      // Only whole lines are indexed, so read on until there is one.
+      const char* p = begin + scanned;
+      size_t got = file->ready();
+      const char* end = begin + got;
+      if (got < file->size) {
+        const char* nl = (const char*) memrchr(p, '\n', end - p);
+        if (nl == nullptr) {
+          file->fill(got + READ_CHUNK);
+          continue;
+        }
+        end = nl + 1;
+      }
+      std::vector<LineTree::Entry> batch;
+      batch.reserve(LOAD_BATCH);
+      p = indexLines(p, end, LOAD_BATCH, batch);
+      scanned = p - begin;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.push_back(std::move(batch));
+      }
+      waker.wake();
+    }
+    finished = true;
+    waker.wake();
+  }
+  void readStream() {
+    std::vector<char> buf(STREAM_CHUNK);
+    std::string partial;
+    std::vector<LineTree::Entry> batch;
+    while (!cancelled) {
+      // Look up every so often to see if we should stop.
+      struct pollfd pfd = {fd, POLLIN, 0};
+      if (poll(&pfd, 1, 100) == 0) continue;
+      ssize_t n = read(fd, buf.data(), buf.size());
+      if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+      if (n <= 0) break;
+      scanned += n;
+      splitStream(buf.data(), buf.data() + n, partial, batch);
+      // Show what we have once the stream pauses, or once there is a lot.
+      pfd.revents = 0;
+      if (batch.size() >= LOAD_BATCH || poll(&pfd, 1, 0) == 0) hand(batch);
+    }
+    // The last line might not have a newline after it.
+    if (!partial.empty()) {
+      Line line(std::move(partial));
+      size_t vlength = wcswidthp(line);
+      batch.push_back({std::move(line), vlength});
+    }
+    hand(batch);
+    finished = true;
+    waker.wake();
+  }
+  void hand(std::vector<LineTree::Entry>& batch) {
+    if (batch.empty()) return;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ready.push_back(std::move(batch));
+    }
+    batch = std::vector<LineTree::Entry>();
+    waker.wake();
+  }
+  static constexpr size_t STREAM_CHUNK = 1 << 20;
+  static constexpr size_t READ_CHUNK = 4 << 20;
+  std::shared_ptr<MappedFile> file;
+  int fd = -1;
+  std::atomic<size_t> scanned;
+  std::atomic<bool> finished{false};
+  std::atomic<bool> cancelled{false};
+  std::mutex mutex;
+  std::vector<std::vector<LineTree::Entry>> ready;
+  // Last, so that it starts after everything else is set up
+  std::thread worker;
+};
+
+// Finds where every STRIDE-th line of a mapped file starts, on another
+// thread, so that a file too big to load can still be paged through by
+// line number. The pages it has read are handed back to the kernel as
+// it goes, which keeps memory use flat however big the file is.
+class LineIndex {
+public:
+  static constexpr size_t STRIDE = 1024;
+  static constexpr size_t CHUNK = 16 << 20;
+  explicit LineIndex(std::shared_ptr<MappedFile> file) :
+    file(file), checkpoints{0},
+    worker(&LineIndex::run, this) {}
+  ~LineIndex() {
+    cancelled = true;
+    worker.join();
+  }
+  bool complete() const {
+    return finished;
+  }
+  // How many lines there are, or SIZE_MAX if that is not known yet
+  size_t lineCount() const {
+    return finished ? total.load() : SIZE_MAX;
+  }
+  // How far into the file we are, in per mille
+  size_t progress() const {
+    return file->size == 0 ? 1000 : scanned * 1000 / file->size;
+  }
+  // Where line row starts, or SIZE_MAX if there are not that many lines.
+  // Lines past what the worker has got to are counted here and now.
+  size_t offsetOf(size_t row) const {
+    size_t offset, left;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      size_t k = std::min(row / STRIDE, checkpoints.size() - 1);
+      offset = checkpoints[k];
+      left = row - k * STRIDE;
+    }
+    const char* p = file->data + offset;
+    const char* end = file->data + file->size;
+    for (; left > 0 && p < end; --left) {
+      const char* nl = (const char*) memchr(p, '\n', end - p);
+      p = (nl == nullptr) ? end : nl + 1;
+    }
+    // A newline at the very end does not start another line.
+    if (left > 0 || (p == end && row > 0))
+      return SIZE_MAX;
+    return p - file->data;
+  }
+  // The number of the line starting at offset, or SIZE_MAX if the worker
+  // has not got that far yet
+  size_t rowOf(size_t offset) const {
+    size_t k, from;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (offset > scanned) return SIZE_MAX;
+      k = std::upper_bound(checkpoints.begin(), checkpoints.end(), offset) -
+        checkpoints.begin() - 1;
+      from = checkpoints[k];
+    }
+    return k * STRIDE + std::count(file->data + from, file->data + offset,
+      '\n');
+  }
+private:
+  void run() {
+    const char* begin = file->data;
+    const char* end = begin + file->size;
+    const char* p = begin;
+    size_t lines = 0;
+    size_t lastProgress = 0;
+    while (p < end && !cancelled) {
+      const char* stop = p + std::min<size_t>(CHUNK, end - p);
+      std::vector<size_t> found;
+      while (p < stop) {
+        const char* nl = (const char*) memchr(p, '\n', stop - p);
+        if (nl == nullptr) {
+          p = stop;
+          break;
+        }
+        p = nl + 1;
+        if (++lines % STRIDE == 0 && p < end) found.push_back(p - begin);
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        checkpoints.insert(checkpoints.end(), found.begin(), found.end());
+        scanned = p - begin;
+      }
+      // Let go of what we have read. It stays in the page cache, and
+      // comes back on its own if it is looked at again.
+      size_t page = sysconf(_SC_PAGESIZE);
+      size_t upTo = (p - begin) / page * page;
+      if (upTo > released) {
+        madvise(const_cast<char*>(begin) + released, upTo - released,
+          MADV_DONTNEED);
+        released = upTo;
+      }
+      if (progress() >= lastProgress + 10) {
+        lastProgress = progress();
+        waker.wake();
+      }
+    }
+    // The last line might not have a newline after it.
+    if (file->size > 0 && end[-1] != '\n') ++lines;
+    total = lines;
+    finished = !cancelled;
+    waker.wake();
+  }
+  std::shared_ptr<MappedFile> file;
+  mutable std::mutex mutex;
+  // checkpoints[k] is where line k * STRIDE starts.
+  std::vector<size_t> checkpoints;
+  std::atomic<size_t> scanned{0};
+  std::atomic<size_t> total{0};
+  size_t released = 0;
+  std::atomic<bool> finished{false};
+  std::atomic<bool> cancelled{false};
+  // Last, so that it starts after everything else is set up
+  std::thread worker;
+};
+
+// Watches a file with inotify and reads whatever gets written to the end
+// of it, like tail -f, splitting it into lines on another thread. The
+// main loop is woken up at most once every INTERVAL milliseconds, so a
+// file that grows very fast costs a few frames a second to show rather
+// than one per write.
+class Follower {
+public:
+  static constexpr int INTERVAL = 50;
+  static constexpr size_t CHUNK = 1 << 20;
+  // Starts reading at byte offset of fname. If continues is set, the
+  // bytes from there on carry on the buffer's last line.
+  Follower(const std::string& fname, size_t offset, bool continues) :
+    fd(::open(fname.c_str(), O_RDONLY | O_CLOEXEC)),
+    inotify(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+    stop(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    offset(offset), continues(continues) {
+    if (inotify >= 0) inotify_add_watch(inotify, fname.c_str(), IN_MODIFY);
+    // Remember what comes right before where we start, to tell later on
+    // if it is still there.
+    size_t back = std::min(offset, SEEN);
+    seen.resize(back);
+    if (fd < 0 || pread(fd, &seen[0], back, offset - back) != (ssize_t) back)
+      seen.clear();
+    worker = std::thread(&Follower::run, this);
+  }
+  ~Follower() {
+    uint64_t one = 1;
+    (void) !write(stop, &one, sizeof(one));
+    worker.join();
+    for (int f : {fd, inotify, stop})
+      if (f >= 0) close(f);
+  }
+  bool ok() const {
+    return fd >= 0 && inotify >= 0;
+  }
+  // Moves the lines that are ready into out. If the first of them
+  // carries on the buffer's last line instead of coming after it,
+  // replaceLast is set.
+  void take(std::vector<LineTree::Entry>& out, bool& replaceLast) {
+    std::lock_guard<std::mutex> lock(mutex);
+    replaceLast = false;
+    if (ready.empty()) return;
+    replaceLast = continues;
+    continues = false;
+    out = std::move(ready);
+    ready.clear();
+  }
+  // Was the file cut short since the last call? We then read it again
+  // from the start.
+  bool shrunk() {
+    return truncated.exchange(false);
+  }
+private:
+  void run() {
+    using Clock = std::chrono::steady_clock;
+    // Nothing has been handed over yet, so the first lines go right away.
+    auto lastWake = Clock::now() - std::chrono::milliseconds(INTERVAL);
+    bool pending = false;
+    while (true) {
+      pending = readMore() || pending;
+      int timeout = -1;
+      if (pending) {
+        auto since = std::chrono::duration_cast<std::chrono::milliseconds>(
+          Clock::now() - lastWake).count();
+        if (since >= INTERVAL) {
+          waker.wake();
+          lastWake = Clock::now();
+          pending = false;
+        } else {
+          timeout = INTERVAL - since;
+        }
+      }
+      struct pollfd fds[2] = {{inotify, POLLIN, 0}, {stop, POLLIN, 0}};
+      if (poll(fds, 2, timeout) < 0 && errno != EINTR) return;
+      if (fds[1].revents != 0) return;
+      // All that matters is that something happened.
+      char events[4096];
+      while (read(inotify, events, sizeof(events)) > 0) {}
+    }
+  }
+  // Reads everything past offset, and returns true if that made any
+  // new lines, or if the file was cut short.
+  bool readMore() {
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) return false;
+    size_t size = st.st_size;
+    size_t at = offset + partial.length();
+    // A log rotated by copying it and then truncating it might already
+    // have grown back past where we were by now.
+    bool cut = size < at || !stillThere(at);
+    if (cut) {
+      offset = 0;
+      at = 0;
+      partial.clear();
+      seen.clear();
+      std::lock_guard<std::mutex> lock(mutex);
+      continues = false;
+      truncated = true;
+    }
+    std::vector<LineTree::Entry> found;
+    std::string chunk;
+    while (at < size) {
+      chunk.resize(std::min(CHUNK, size - at));
+      ssize_t n = pread(fd, &chunk[0], chunk.length(), at);
+      if (n <= 0) break;
+      at += n;
+      splitStream(chunk.data(), chunk.data() + n, partial, found);
+      offset = at - partial.length();
+      seen.append(chunk.data(), n);
+      if (seen.length() > SEEN) seen.erase(0, seen.length() - SEEN);
+    }
+    if (found.empty()) return cut;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (ready.empty()) ready = std::move(found);
+    else for (auto& entry : found) ready.push_back(std::move(entry));
+    return true;
+  }
+  // Are the last bytes read before at still there?
+  bool stillThere(size_t at) const {
+    if (seen.empty()) return true;
+    std::string now(seen.length(), '\0');
+    ssize_t n = pread(fd, &now[0], now.length(), at - seen.length());
+    return n == (ssize_t) now.length() && now == seen;
+  }
+  static constexpr size_t SEEN = 64;
+  int fd, inotify, stop;
+  // Where the line being read starts, and what we have of it so far
+  size_t offset;
+  std::string partial;
+  // The last SEEN bytes read
+  std::string seen;
+  std::mutex mutex;
+  std::vector<LineTree::Entry> ready;
+  bool continues;
+  std::atomic<bool> truncated{false};
+  std::thread worker;
+};
+
+// Notices when something else changes a file, and works out how much of
+// it changed. The file is summed up block by block, counting from the
+// start and from the end, so that a change in the middle that shifts
+// the rest along still leaves both ends matching. All the reading is
+// done on another thread; the main loop is woken up once the file has
+// been quiet for SETTLE_TIME milliseconds.
+class FileWatcher {
+public:
+  static constexpr size_t BLOCK = 64 << 10;
+  static constexpr int SETTLE_TIME = 100;
+  struct Change {
+    // Was the file replaced by a new one, rather than written over?
+    bool replaced;
+    size_t oldSize, newSize;
+    // The first prefix and last suffix bytes are the same as before.
+    size_t prefix, suffix;
+    // How many newlines there are in those, and in the whole old file
+    size_t prefixNewlines, suffixNewlines, oldNewlines;
+    // How many lines the old file had, as a buffer would split it
+    size_t oldLines;
+  };
+  explicit FileWatcher(const std::string& fname) :
+    fname(fname),
+    stop(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    worker(&FileWatcher::run, this) {}
+  ~FileWatcher() {
+    uint64_t one = 1;
+    (void) !write(stop, &one, sizeof(one));
+    worker.join();
+    if (stop >= 0) close(stop);
+  }
+  // Hands over the last change, if there is one that has not been.
+  bool take(Change& out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!changed) return false;
+    out = change;
+    changed = false;
+    return true;
+  }
+private:
+  // The file as it was at some point
+  struct Summary {
+    ino_t ino = 0;
+    size_t size = 0;
+    bool newlineAtEnd = false;
+    // Blocks counted from the start, then from the end
+    std::vector<uint64_t> front, back;
+    std::vector<uint32_t> frontNewlines, backNewlines;
+  };
+  static uint64_t hashBlock(const char* p, size_t n) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ n;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      uint64_t w;
+      memcpy(&w, p + i, 8);
+      h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+      h ^= h >> 32;
+    }
+    for (; i < n; ++i) h = (h ^ (unsigned char) p[i]) * 0x100000001B3ULL;
+    return h;
+  }
+  bool summarize(Summary& out) const {
+    struct stat st;
+    if (stat(fname.c_str(), &st) != 0) return false;
+    std::shared_ptr<MappedFile> file = MappedFile::open(fname.c_str());
+    if (file == nullptr) return false;
+    out.ino = st.st_ino;
+    out.size = file->size;
+    out.newlineAtEnd = file->size > 0 && file->data[file->size - 1] == '\n';
+    size_t blocks = (file->size + BLOCK - 1) / BLOCK;
+    out.front.resize(blocks);
+    out.frontNewlines.resize(blocks);
+    out.back.resize(blocks);
+    out.backNewlines.resize(blocks);
+    const char* p = file->data;
+    size_t size = file->size;
+    for (size_t i = 0; i < blocks; ++i) {
+      size_t begin = i * BLOCK, n = std::min(BLOCK, size - begin);
+      out.front[i] = hashBlock(p + begin, n);
+      out.frontNewlines[i] = std::count(p + begin, p + begin + n, '\n');
+      size_t end = size - i * BLOCK;
+      n = std::min(BLOCK, end);
+      out.back[i] = hashBlock(p + end - n, n);
+      out.backNewlines[i] = std::count(p + end - n, p + end, '\n');
+    }
+    return true;
+  }
+  // Works out what changed between old and now, if anything did.
+  static bool compare(const Summary& old, const Summary& now, Change& out) {
+    size_t blocks = std::min(old.front.size(), now.front.size());
+    size_t limit = std::min(old.size, now.size);
+    size_t head = 0;
+    while (head < blocks && old.front[head] == now.front[head]) ++head;
+    if (head == blocks && old.size == now.size) return false;
+    head = std::min(head, limit / BLOCK);
+    // Only whole blocks that are not part of the matching start count.
+    size_t tail = 0, tailLimit = (limit - head * BLOCK) / BLOCK;
+    while (tail < tailLimit && old.back[tail] == now.back[tail]) ++tail;
+    out.replaced = old.ino != now.ino;
+    out.oldSize = old.size;
+    out.newSize = now.size;
+    out.prefix = head * BLOCK;
+    out.suffix = tail * BLOCK;
+    out.prefixNewlines = std::accumulate(old.frontNewlines.begin(),
+      old.frontNewlines.begin() + head, (size_t) 0);
+    out.suffixNewlines = std::accumulate(old.backNewlines.begin(),
+      old.backNewlines.begin() + tail, (size_t) 0);
+    out.oldNewlines = std::accumulate(old.frontNewlines.begin(),
+      old.frontNewlines.end(), (size_t) 0);
+    out.oldLines = out.oldNewlines + (old.size > 0 && !old.newlineAtEnd);
+    return true;
+  }
+  void run() {
+    Summary known;
+    if (!summarize(known)) return;
+    // Watch the directory, so that the file being replaced shows up too.
+    size_t slash = fname.rfind('/');
+    std::string dir = slash == std::string::npos ? "." :
+      slash == 0 ? "/" : fname.substr(0, slash);
+    std::string base = fname.substr(slash + 1);
+    int inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify < 0) return;
+    inotify_add_watch(inotify, dir.c_str(),
+      IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    bool settling = false;
+    while (true) {
+      struct pollfd fds[2] = {{inotify, POLLIN, 0}, {stop, POLLIN, 0}};
+      int ready = poll(fds, 2, settling ? SETTLE_TIME : -1);
+      if (ready < 0 && errno != EINTR) break;
+      if (fds[1].revents != 0) break;
+      if (ready == 0) {
+        settling = false;
+        Summary now;
+        Change c;
+        if (!summarize(now) || !compare(known, now, c)) continue;
+        known = std::move(now);
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          change = c;
+          changed = true;
+        }
+        waker.wake();
+        continue;
+      }
+      alignas(struct inotify_event) char events[4096];
+      ssize_t n;
+      while ((n = read(inotify, events, sizeof(events))) > 0) {
+        for (char* p = events; p < events + n; ) {
+          auto* e = (struct inotify_event*) p;
+          if (e->len > 0 && base == e->name) settling = true;
+          p += sizeof(struct inotify_event) + e->len;
+        }
+      }
+    }
+    close(inotify);
+  }
+  std::string fname;
+  int stop;
+  std::mutex mutex;
+  Change change;
+  bool changed = false;
+  // Last, so that it starts after everything else is set up
+  std::thread worker;
+};
+
+// Writes lines to a temporary file next to fname and renames it into
+// place, so that a crash partway through leaves the old file as it
+// was. Since the mapped file is replaced rather than written over,
+// unedited lines can keep pointing into it.
+std::error_code writeLines(const LineTree& lines,
+    const MappedFile* mapping, const std::string& fname) {
+  // Create the parent directory (if needed)
+  size_t lastSlash = fname.rfind('/');
+  if (lastSlash != std::string::npos) {
+    int stat = mkdirRecursive(fname.substr(0, lastSlash));
+    if (stat != 0) return std::error_code(stat, std::system_category());
+  }
+  // Save through symbolic links instead of replacing them.
+  std::string target = fname;
+  struct stat st;
+  if (lstat(fname.c_str(), &st) == 0 && S_ISLNK(st.st_mode)) {
+    char* real = realpath(fname.c_str(), nullptr);
+    if (real != nullptr) {
+      target = real;
+      free(real);
+    }
+  }
+  // Keep the permissions of the file we are replacing, or use the
+  // ones a new file would get.
+  bool existed = stat(target.c_str(), &st) == 0;
+  mode_t mode;
+  if (existed) {
+    mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    mode = 0666 & ~mask;
+  }
+  std::string temp = target + ".XXXXXX";
+  int fd = mkstemp(&temp[0]);
+  if (fd < 0) return std::error_code(errno, std::system_category());
+  auto fail = [&]() {
+    std::error_code err(errno, std::system_category());
+    close(fd);
+    unlink(temp.c_str());
+    return err;
+  };
+  if (existed) {
+    // Only works for root or when nothing changes, which is fine.
+    (void) !fchown(fd, st.st_uid, st.st_gid);
+  }
+  if (fchmod(fd, mode) != 0) return fail();
+  // Output each line. Unedited lines that still have their line
+  // break after them in the mapping go out along with it.
+  GatherWriter out(fd);
+  bool ok = true;
+  lines.forEach([&](const Line& line) {
+    if (!ok) return;
+    for (size_t i = 0; i < line.length();) {
+      auto [p, n] = line.run(i);
+      ok = ok && out.add(p, n);
+      i += n;
+    }
+    const char* after =
+      line.isView() ? line.run(0).first + line.length() : nullptr;
+    if (mapping != nullptr && mapping->contains(after) && *after == '\n')
+      ok = ok && out.add(after, 1);
+    else
+      ok = ok && out.add("\n", 1);
+  });
+  if (!ok || !out.flush() || fsync(fd) != 0) return fail();
+  if (close(fd) != 0) {
+    std::error_code err(errno, std::system_category());
+    unlink(temp.c_str());
+    return err;
+  }
+  if (rename(temp.c_str(), target.c_str()) != 0) {
+    std::error_code err(errno, std::system_category());
+    unlink(temp.c_str());
+    return err;
+  }
+  // Make sure the rename itself survives a crash.
+  size_t dirEnd = target.rfind('/');
+  std::string dir = dirEnd == std::string::npos ? "." :
+    dirEnd == 0 ? "/" : target.substr(0, dirEnd);
+  int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dirfd >= 0) {
+    fsync(dirfd);
+    close(dirfd);
+  }
+  return std::error_code();
+}
+
+// Writes a snapshot of the buffer out on a thread of its own, so that
+// editing can go on in the meantime. revision is that of the buffer
+// when the snapshot was taken.
+class SaveJob {
+public:
+  SaveJob(const LineTree& lines, std::shared_ptr<MappedFile> file,
+      const std::string& fname, size_t revision) :
+    fname(fname), revision(revision), lines(lines), file(file),
+    worker(&SaveJob::run, this) {}
+  ~SaveJob() {
+    wait();
+  }
+  bool done() const {
+    return finished;
+  }
+  void wait() {
+    if (worker.joinable()) worker.join();
+  }
+  // Only meaningful once the job is done
+  std::error_code result() const {
+    return error;
+  }
+  const std::string fname;
+  const size_t revision;
+private:
+  void run() {
+    error = writeLines(lines, file.get(), fname);
+    finished = true;
+    waker.wake();
+  }
+  LineTree lines;
+  std::shared_ptr<MappedFile> file;
+  std::error_code error;
+  std::atomic<bool> finished{false};
+  // Last, so that it starts after everything else is set up
+  std::thread worker;
+};
+
+// Keeps a record of every edit under ~/.veneplU_dat/journal, so that
+// edits which never got saved can be brought back after a crash. Edits
+// are only added to a buffer here; a thread of its own writes them out
+// in batches, at most FLUSH_DELAY after they were made. The journal
+// starts over after each save.
+//
+// The file starts with a header saying which version of the file the
+// edits apply to, followed by the edits in the order they were made.
+// Numbers are written as varints, so a typed character takes about
+// six bytes.
+class Journal {
+public:
+  struct Entry {
+    Edit edit;
+    // Was the edit undone rather than made?
+    bool backwards;
+  };
+  Journal() : worker(&Journal::run, this) {}
+  ~Journal() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+    if (fd >= 0) close(fd);
+  }
+  // Starts a new journal for fname as it is now. Nothing is written
+  // until the first edit comes in.
+  void track(const std::string& fname) {
+    path = pathFor(fname);
+    header = headerFor(fname);
+    started = false;
+    written = 0;
+  }
+  void append(const Edit& e, bool backwards) {
+    if (path.empty()) return;
+    if (!e.parts.empty()) {
+      if (backwards) {
+        for (auto it = e.parts.rbegin(); it != e.parts.rend(); ++it)
+          append(*it, true);
+      } else {
+        for (const Edit& part : e.parts) append(part, false);
+      }
+      return;
+    }
+    if (!started) {
+      started = true;
+      std::string p = path, h = header;
+      queue([this, p, h]() {
+        mkdirRecursive(p.substr(0, p.rfind('/')));
+        if (fd >= 0) close(fd);
+        fd = ::open(p.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        writeAll(h);
+        headerLength = h.length();
+      });
+    }
+    std::string record;
+    putVarint(record, e.row);
+    putVarint(record, e.col);
+    record += (char) ((e.newRow ? 1 : 0) | (backwards ? 2 : 0));
+    putVarint(record, e.removed.length());
+    putVarint(record, e.inserted.length());
+    record += e.removed;
+    record += e.inserted;
+    written += record.length();
+    bool wasIdle;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      wasIdle = pending.empty() && tasks.empty();
+      pending += record;
+    }
+    if (wasIdle) wake.notify_one();
+  }
+  // How many bytes of edits have been added so far
+  size_t size() const {
+    return written;
+  }
+  // Makes the journal start over from fname, which has just been saved
+  // with the edits in the first mark bytes.
+  void rebase(const std::string& fname, size_t mark) {
+    std::string oldPath = path;
+    bool hadEdits = started;
+    track(fname);
+    if (!hadEdits) return;
+    if (written == mark) {
+      // Nothing came in while saving.
+      queue([this, oldPath]() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+        unlink(oldPath.c_str());
+      });
+      return;
+    }
+    started = true;
+    written -= mark;
+    std::string p = path, h = header;
+    queue([this, oldPath, p, h, mark]() {
+      // Keep the edits made while the save was going on.
+      std::string tail;
+      int in = ::open(oldPath.c_str(), O_RDONLY);
+      if (in >= 0) {
+        off_t from = headerLength + mark;
+        char buf[65536];
+        ssize_t n;
+        while ((n = pread(in, buf, sizeof(buf), from)) > 0) {
+          tail.append(buf, n);
+          from += n;
+        }
+        close(in);
+      }
+      if (fd >= 0) close(fd);
+      mkdirRecursive(p.substr(0, p.rfind('/')));
+      std::string temp = p + ".XXXXXX";
+      fd = mkstemp(&temp[0]);
+      writeAll(h);
+      writeAll(tail);
+      headerLength = h.length();
+      rename(temp.c_str(), p.c_str());
+      if (oldPath != p) unlink(oldPath.c_str());
+    });
+  }
+  // Throws the journal away, once nothing in it is needed any more.
+  void discard() {
+    if (path.empty()) return;
+    std::string p = path;
+    started = false;
+    written = 0;
+    queue([this, p]() {
+      if (fd >= 0) close(fd);
+      fd = -1;
+      unlink(p.c_str());
+    });
+  }
+  // Reads back the journal for fname, if there is one newer than the
+  // file and meant for the file as it is now. Stops at the first edit
+  // that was cut off.
+  static void load(const std::string& fname, std::vector<Entry>& out) {
+    std::string p = pathFor(fname);
+    struct stat jst, fst;
+    if (stat(p.c_str(), &jst) != 0) return;
+    if (stat(fname.c_str(), &fst) == 0 &&
+        (jst.st_mtim.tv_sec < fst.st_mtim.tv_sec ||
+          (jst.st_mtim.tv_sec == fst.st_mtim.tv_sec &&
+            jst.st_mtim.tv_nsec < fst.st_mtim.tv_nsec)))
+      return;
+    std::ifstream fh(p, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(fh)),
+      std::istreambuf_iterator<char>());
+    std::string h = headerFor(fname);
+    if (data.compare(0, h.length(), h) != 0) return;
+    size_t i = h.length();
+    while (i < data.length()) {
+      Entry entry;
+      uint64_t removed, inserted;
+      if (!getVarint(data, i, entry.edit.row) ||
+          !getVarint(data, i, entry.edit.col) || i >= data.length())
+        break;
+      int flags = data[i++];
+      entry.edit.newRow = (flags & 1) != 0;
+      entry.backwards = (flags & 2) != 0;
+      if (!getVarint(data, i, removed) || !getVarint(data, i, inserted) ||
+          data.length() - i < removed + inserted)
+        break;
+      entry.edit.removed = data.substr(i, removed);
+      entry.edit.inserted = data.substr(i + removed, inserted);
+      i += removed + inserted;
+      out.push_back(std::move(entry));
+    }
+  }
+private:
+  static constexpr auto FLUSH_DELAY = std::chrono::milliseconds(200);
+  // Where the journal for fname goes. The absolute path of the file
+  // becomes the name, with '/' turned into '%' and '%' doubled.
+  static std::string pathFor(const std::string& fname) {
+    std::string full = fname;
+    char* real = realpath(fname.c_str(), nullptr);
+    if (real == nullptr) {
+      // The file might not exist yet.
+      size_t slash = fname.rfind('/');
+      std::string dir = slash == std::string::npos ? "." :
+        slash == 0 ? "/" : fname.substr(0, slash);
+      real = realpath(dir.c_str(), nullptr);
+      if (real != nullptr)
+        full = std::string(real) + "/" + fname.substr(slash + 1);
+    } else {
+      full = real;
+    }
+    free(real);
+    std::string name;
+    for (char c : full) {
+      if (c == '%') name += "%%";
+      else if (c == '/') name += '%';
+      else name += c;
+    }
+    return getHome() + "/.veneplU_dat/journal/" + name;
+  }
+  // Tells this version of fname apart from others
+  static std::string headerFor(const std::string& fname) {
+    std::string h = "veneplU journal\n";
+    struct stat st;
+    if (stat(fname.c_str(), &st) == 0) {
+      h += '\1';
+      putVarint(h, st.st_ino);
+      putVarint(h, st.st_size);
+      putVarint(h, st.st_mtim.tv_sec);
+      putVarint(h, st.st_mtim.tv_nsec);
+    } else {
+      h += '\0';
+    }
+    return h;
+  }
+  static void putVarint(std::string& out, uint64_t n) {
+    while (n >= 128) {
+      out += (char) (n | 128);
+      n >>= 7;
+    }
+    out += (char) n;
+  }
+  template<typename T>
+  static bool getVarint(const std::string& in, size_t& i, T& out) {
+    uint64_t n = 0;
+    for (int shift = 0; i < in.length() && shift < 64; shift += 7) {
+      unsigned char c = in[i++];
+      n |= (uint64_t) (c & 127) << shift;
+      if (c < 128) {
+        out = n;
+        return true;
+      }
+    }
+    return false;
+  }
+  // Runs f on the worker once everything added before it is written.
+  void queue(std::function<void()> f) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!pending.empty()) {
+        std::string batch = std::move(pending);
+        pending.clear();
+        tasks.push_back([this, batch]() { writeAll(batch); });
+      }
+      tasks.push_back(std::move(f));
+    }
+    wake.notify_one();
+  }
+  // The journal is a best effort; if it cannot be written, editing
+  // goes on without it.
+  void writeAll(const std::string& data) {
+    size_t done = 0;
+    while (fd >= 0 && done < data.length()) {
+      ssize_t n = write(fd, data.data() + done, data.length() - done);
+      if (n < 0 && errno != EINTR) return;
+      if (n > 0) done += n;
+    }
+  }
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wake.wait(lock, [this]() {
+        return stopping || !pending.empty() || !tasks.empty();
+      });
+      // Give more edits a chance to join the batch.
+      wake.wait_for(lock, FLUSH_DELAY, [this]() {
+        return stopping || !tasks.empty();
+      });
+      std::vector<std::function<void()>> todo = std::move(tasks);
+      tasks.clear();
+      std::string batch = std::move(pending);
+      pending.clear();
+      bool stop = stopping;
+      lock.unlock();
+      for (auto& f : todo) f();
+      writeAll(batch);
+      if (fd >= 0) fdatasync(fd);
+      lock.lock();
+      if (stop && pending.empty() && tasks.empty()) break;
+    }
+  }
+  // Used by the editor only
+  std::string path, header;
+  bool started = false;
+  size_t written = 0;
+  // Used by the worker only
+  int fd = -1;
+  size_t headerLength = 0;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::string pending;
+  std::vector<std::function<void()>> tasks;
+  bool stopping = false;
+  // Last, so that it starts after everything else is set up
+  std::thread worker;
+};
+
+// Looks for text in a snapshot of the buffer on a thread of its own,
+// from (row, col) to the end and then from the top back round to it.
+class SearchJob {
+public:
+  SearchJob(const LineTree& lines, const std::string& needle,
+      size_t row, size_t col) :
+    needle(needle), lines(lines), row(row), col(col),
+    worker(&SearchJob::run, this) {}
+  ~SearchJob() {
+    cancelled = true;
+    wait();
+  }
+  bool done() const {
+    return finished;
+  }
+  void wait() {
+    if (worker.joinable()) worker.join();
+  }
+  // Only meaningful once the job is done
+  bool result(size_t& foundRow, size_t& foundCol) const {
+    foundRow = matchRow;
+    foundCol = matchCol;
+    return found;
+  }
+  const std::string needle;
+private:
+  // Unedited lines that follow one another in the mapped file are
+  // searched together, up to this many bytes at a time.
+  static constexpr size_t BLOCK_MAX = 1 << 20;
+  void run() {
+    found = search(row, col, SIZE_MAX, 0) || search(0, 0, row, col);
+    finished = true;
+    waker.wake();
+  }
+  // Looks for the first match at or after (fromRow, fromCol) that starts
+  // before (endRow, endCol).
+  bool search(size_t fromRow, size_t fromCol, size_t endRow, size_t endCol) {
+    auto before = [&](size_t r, size_t c) {
+      return r < endRow || (r == endRow && c < endCol);
+    };
+    // The lines gathered so far are [start, end), with a line break
+    // between each of them.
+    const char* start = nullptr;
+    const char* end = nullptr;
+    size_t startRow = 0, startCol = 0;
+    bool hit = false;
+    // Searches the lines gathered so far; returns true if that settles it.
+    auto flush = [&]() {
+      if (start == nullptr) return false;
+      const char* p = start;
+      start = nullptr;
+      size_t at = findBytes(p, end - p, needle);
+      if (at == std::string::npos) return false;
+      const char* match = p + at;
+      size_t r = startRow, c = startCol;
+      while (const char* nl = (const char*) memchr(p, '\n', match - p)) {
+        ++r;
+        c = 0;
+        p = nl + 1;
+      }
+      c += match - p;
+      if (before(r, c)) {
+        matchRow = r;
+        matchCol = c;
+        hit = true;
+      }
+      return true;
+    };
+    bool joinable = needle.find('\n') == std::string::npos;
+    lines.forEachFrom(fromRow, [&](size_t r, const Line& line) {
+      if (cancelled) return false;
+      if (!before(r, 0)) {
+        flush();
+        return false;
+      }
+      size_t c = r == fromRow ? std::min(fromCol, line.length()) : 0;
+      if (joinable && line.isView()) {
+        auto [p, n] = line.run(c);
+        if (start != nullptr && p == end + 1 && *end == '\n' &&
+            (size_t) (end - start) < BLOCK_MAX) {
+          end = p + n;
+          return true;
+        }
+        if (flush()) return false;
+        start = p;
+        end = p + n;
+        startRow = r;
+        startCol = c;
+        return true;
+      }
+      if (flush()) return false;
+      size_t at = line.find(needle, c);
+      if (at == std::string::npos) return true;
+      if (before(r, at)) {
+        matchRow = r;
+        matchCol = at;
+        hit = true;
+      }
+      return false;
+    });
+    if (!cancelled) flush();
+    return hit;
+  }
+  LineTree lines;
+  size_t row, col;
+  size_t matchRow = 0, matchCol = 0;
+  bool found = false;
+  std::atomic<bool> cancelled{false};
+  std::atomic<bool> finished{false};
+  // Last, so that it starts after everything else is set up
+  std::thread worker;
+};
+
+// Replaces every match of a pattern in a snapshot of the buffer. The
+// lines are cut into ranges of RANGE_ROWS, which a pool of threads take
+// in turn. Each range gets a list of its own for the lines it changed,
+// so that putting them back together keeps them in order.
+class ReplaceJob {
+public:
+  // A line that changed, and the smallest edit that changes it
+  struct Change {
+    Line text;
+    size_t vlength;
+    Edit edit;
+  };
+  // If re is given, it is used instead of pattern, and with is a format
+  // as for std::regex_replace.
+  ReplaceJob(const LineTree& lines, const std::string& pattern,
+      std::unique_ptr<std::regex> re, const std::string& with) :
+      lines(lines), pattern(pattern), re(std::move(re)), with(with),
+      total(lines.size()), results((total + RANGE_ROWS - 1) / RANGE_ROWS) {
+    size_t n = std::max(1u, std::thread::hardware_concurrency());
+    running = n;
+    for (size_t i = 0; i < n; ++i)
+      workers.emplace_back(&ReplaceJob::work, this);
+  }
+  ~ReplaceJob() {
+    cancel();
+    wait();
+  }
+  void cancel() {
+    cancelled = true;
+  }
+  bool done() const {
+    return finished;
+  }
+  void wait() {
+    for (auto& worker : workers)
+      if (worker.joinable()) worker.join();
+  }
+  // Out of 1000
+  size_t progress() const {
+    return total == 0 ? 1000 : rowsDone * 1000 / total;
+  }
+  // These are only meaningful once the job is done.
+  bool wasCancelled() const {
+    return cancelled;
+  }
+  const std::string& error() const {
+    return failure;
+  }
+  // Lines too long to match a regular expression against
+  size_t skipped() const {
+    return skippedLines;
+  }
+  // The changes for each range in turn
+  std::vector<std::vector<Change>> take() {
+    return std::move(results);
+  }
+private:
+  static constexpr size_t RANGE_ROWS = 4096;
+  // std::regex goes through the stack quickly on long lines.
+  static constexpr size_t REGEX_LINE_MAX = 16384;
+  void work() {
+    try {
+      while (!cancelled) {
+        size_t range = nextRange++;
+        if (range >= results.size()) break;
+        size_t to = std::min(total, (range + 1) * RANGE_ROWS);
+        auto& out = results[range];
+        lines.forEachFrom(range * RANGE_ROWS,
+          [&](size_t row, const Line& line) {
+            if (row >= to || cancelled) return false;
+            Change change;
+            if (replaceLine(row, line, change))
+              out.push_back(std::move(change));
+            return true;
+          });
+        rowsDone += to - range * RANGE_ROWS;
+      }
+    } catch (const std::exception& e) {
+      std::lock_guard<std::mutex> lock(mutex);
+      failure = e.what();
+      cancelled = true;
+    }
+    if (--running == 0) {
+      finished = true;
+      waker.wake();
+    }
+  }
+  // Works out what line turns into; returns false if it stays the same.
+  bool replaceLine(size_t row, const Line& line, Change& change) {
+    if (re == nullptr) {
+      if (line.find(pattern) == std::string::npos) return false;
+    } else if (line.length() > REGEX_LINE_MAX) {
+      ++skippedLines;
+      return false;
+    }
+    // Only lines kept in chunks need copying to be matched against.
+    auto [p, n] = line.run(0);
+    std::string copy;
+    if (n < line.length()) {
+      copy = line.str();
+      p = copy.data();
+      n = copy.length();
+    }
+    std::string result;
+    result.reserve(n + with.length());
+    if (re == nullptr) {
+      size_t pos = 0;
+      size_t at;
+      while ((at = findBytes(p + pos, n - pos, pattern)) !=
+          std::string::npos) {
+        result.append(p + pos, at);
+        result += with;
+        pos += at + pattern.length();
+      }
+      result.append(p + pos, n - pos);
+    } else {
+      if (!std::regex_search(p, p + n, *re)) return false;
+      std::regex_replace(std::back_inserter(result), p, p + n, *re, with);
+    }
+    if (result.compare(0, std::string::npos, p, n) == 0) return false;
+    // Leave out what stayed the same at either end.
+    size_t shorter = std::min(n, result.length());
+    size_t prefix =
+      std::mismatch(p, p + shorter, result.begin()).first - p;
+    size_t suffix = 0;
+    while (suffix < shorter - prefix &&
+        p[n - 1 - suffix] == result[result.length() - 1 - suffix])
+      ++suffix;
+    change.edit = {row, prefix,
+      std::string(p + prefix, n - prefix - suffix),
+      result.substr(prefix, result.length() - prefix - suffix)};
+    change.vlength = wcswidthp(result);
+    change.text = Line(std::move(result));
+    return true;
+  }
+  LineTree lines;
+  std::string pattern;
+  std::unique_ptr<std::regex> re;
+  std::string with;
+  size_t total;
+  std::vector<std::vector<Change>> results;
+  std::atomic<size_t> nextRange{0};
+  std::atomic<size_t> rowsDone{0};
+  std::atomic<size_t> skippedLines{0};
+  std::atomic<size_t> running{0};
+  std::atomic<bool> cancelled{false};
+  std::atomic<bool> finished{false};
+  std::mutex mutex;
+  std::string failure;
+  std::vector<std::thread> workers;
+};
+
+// Counts of values on a log scale: each power of two is split into
+// SUB_BUCKETS, so a percentile is within about 6% of the real one.
+// Recording a value is a few instructions and never allocates.
+class Histogram {
+public:
+  static constexpr int SUB_BITS = 4;
+  static constexpr size_t SUB_BUCKETS = 1 << SUB_BITS;
+  void record(uint64_t v) {
+    ++counts[bucketOf(v)];
+    ++total;
+    sum += v;
+    if (v > largest) largest = v;
+  }
+  uint64_t count() const { return total; }
+  uint64_t max() const { return largest; }
+  uint64_t mean() const { return total == 0 ? 0 : sum / total; }
+  // The value that p of the recorded values are at most, for p in [0, 1]
+  uint64_t percentile(double p) const {
+    if (total == 0) return 0;
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t) std::ceil(p * total));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      seen += counts[i];
+      if (seen >= rank) return std::min(upperBound(i), largest);
+    }
+    return largest;
+  }
+  void clear() { *this = Histogram(); }
+private:
+  static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+  static size_t bucketOf(uint64_t v) {
+    if (v < SUB_BUCKETS) return v;
+    int e = 63 - __builtin_clzll(v);
+    return (e - SUB_BITS + 1) * SUB_BUCKETS +
+      ((v >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+  }
+  static uint64_t upperBound(size_t i) {
+    if (i < SUB_BUCKETS) return i;
+    int e = i / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t low = ((uint64_t) (SUB_BUCKETS + i % SUB_BUCKETS)) <<
+      (e - SUB_BITS);
+    return low + ((uint64_t) 1 << (e - SUB_BITS)) - 1;
+  }
+  uint64_t counts[BUCKETS] = {};
+  uint64_t total = 0, sum = 0, largest = 0;
+};
+
+// Where the time between a key coming in and the frame that shows it
+// goes. Times are in nanoseconds.
+class Stats {
+public:
+  enum Stage {
+    KEY, // decoding the key
+    REACT, // changing the buffer
+    DRAW, // building the output for a frame
+    WRITE, // sending it to the terminal
+    TOTAL, // from the key coming in to the write being done
+    STAGE_COUNT
+  };
+  using Clock = std::chrono::steady_clock;
+  static uint64_t since(Clock::time_point from) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      Clock::now() - from).count();
+  }
+  void record(Stage stage, Clock::time_point from) {
+    stages[stage].record(since(from));
+  }
+  void recordFrame(size_t bytes) { frameBytes.record(bytes); }
+  // One line with the median and 99th percentile of each stage
+  std::string summary() const {
+    std::string s;
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+      s += STAGE_NAMES[i][0];
+      s += ' ';
+      s += formatNanos(stages[i].percentile(0.5));
+      s += '/';
+      s += formatNanos(stages[i].percentile(0.99));
+      s += ' ';
+    }
+    s += "B ";
+    s += formatBytes(frameBytes.percentile(0.5));
+    s += '/';
+    s += formatBytes(frameBytes.percentile(0.99));
+    return s;
+  }
+  // Writes every stage out as a table.
+  bool dump(const std::string& fname) const {
+    std::ofstream fh(fname);
+    if (fh.fail()) return false;
+    char line[160];
+    snprintf(line, sizeof(line), "%-8s %10s %10s %10s %10s %10s %10s\n",
+      "stage", "count", "mean", "p50", "p90", "p99", "max");
+    fh << line;
+    auto row = [&](const char* name, const Histogram& h, const char* unit) {
+      snprintf(line, sizeof(line),
+        "%-8s %10llu %10llu %10llu %10llu %10llu %10llu %s\n", name,
+        (unsigned long long) h.count(), (unsigned long long) h.mean(),
+        (unsigned long long) h.percentile(0.5),
+        (unsigned long long) h.percentile(0.9),
+        (unsigned long long) h.percentile(0.99),
+        (unsigned long long) h.max(), unit);
+      fh << line;
+    };
+    for (int i = 0; i < STAGE_COUNT; ++i)
+      row(STAGE_NAMES[i], stages[i], "ns");
+    row("frame", frameBytes, "bytes");
+    return !fh.fail();
+  }
+private:
+  static constexpr const char* STAGE_NAMES[STAGE_COUNT] = {
+    "key", "react", "draw", "write", "total",
+  };
+  static std::string formatNanos(uint64_t ns) {
+    char s[16];
+    if (ns < 1000) snprintf(s, sizeof(s), "%lluns", (unsigned long long) ns);
+    else if (ns < 1000000) snprintf(s, sizeof(s), "%.3gus", ns / 1e3);
+    else snprintf(s, sizeof(s), "%.3gms", ns / 1e6);
+    return s;
+  }
+  static std::string formatBytes(uint64_t n) {
+    char s[16];
+    if (n < 1000) snprintf(s, sizeof(s), "%llu", (unsigned long long) n);
+    else snprintf(s, sizeof(s), "%.3gK", n / 1e3);
+    return s;
+  }
+  Histogram stages[STAGE_COUNT];
+  Histogram frameBytes;
+};
+
+// Everything the status line says, in one place so that it can all be
+// translated together. {} stands for whatever is filled in.
+//
+// Each message has its text in the editor's language and in English.
+// The ones from after the first release have no translation yet, and
+// those are shown in English until one is added here. Putting
+// `english = yes` in ~/.veneplU_dat/options shows every message in
+// English, so that the status line is never in two languages at once.
+enum Messages {
+  M_SAVE_AS = 0,
+  M_NOT_SAVED,
+  M_SAVE_FAILED,
+  M_SAVED,
+  M_RECOVER,
+  M_PARTLY_RECOVERED,
+  M_RECOVERED,
+  M_FOLLOW_VIEWED,
+  M_NOTHING_TO_FOLLOW,
+  M_CANNOT_FOLLOW,
+  M_FOLLOW_SHRUNK,
+  M_FOLLOW_EDITED,
+  M_STILL_STREAMING,
+  M_CHANGED_ELSEWHERE,
+  M_REMOVED_ELSEWHERE,
+  M_RELOADED,
+  M_VIEWING,
+  M_VIEW_ONLY,
+  M_VIEW_CUT,
+  M_GO_TO,
+  M_NOT_A_LINE,
+  M_TOO_FEW_LINES,
+  M_LINE_GONE,
+  M_FIND,
+  M_NOT_FOUND,
+  M_REPLACE,
+  M_WITH,
+  M_BAD_PATTERN,
+  M_REPLACING,
+  M_REPLACE_FAILED,
+  M_REPLACE_CANCELLED,
+  M_REPLACED,
+  M_TOO_LONG,
+  M_BAD_OPTION,
+  M_BAD_OPTIONS_2,
+  M_BAD_OPTIONS,
+  M_COUNT,
+};
+
+struct MessageText {
+  // nullptr if it has not been translated yet
+  const char* native;
+  const char* english;
+};
+
+const MessageText messageTexts[M_COUNT] = {
+  {"Sydál kentos mej kemeṫys?", "Save under what name?"},
+  {"Syda kêl nelterus.", "Not saved."},
+  {"Syda kêl nelteġerus: {}", "Could not save: {}"},
+  {"Syda nelterus.", "Saved."},
+  {nullptr, "Unsaved changes to this file were found. Recover them?"},
+  {nullptr, "Only some of the changes could be recovered."},
+  {nullptr, "Changes recovered."},
+  {nullptr, "Files that are only being viewed cannot be followed."},
+  {nullptr, "There is no file to follow."},
+  {nullptr, "This file cannot be followed."},
+  {nullptr, "The file got shorter; following it from the start again."},
+  {nullptr, "The last line was edited; the file's version is below it."},
+  {nullptr, "This cannot be saved until all of the input has come in."},
+  {nullptr, "The file was changed by something else."},
+  {nullptr, "The file was removed by something else."},
+  {nullptr, "The file was changed by something else. Lines read again: {}"},
+  {nullptr, "(view)"},
+  {nullptr, "This is only being viewed."},
+  {nullptr, "The file got shorter; what is past its new end shows as NULs."},
+  {nullptr, "Go to line:"},
+  {nullptr, "That is not a line number."},
+  {nullptr, "There are not that many lines."},
+  {nullptr, "That line is no longer kept."},
+  {nullptr, "Find:"},
+  {nullptr, "Not found."},
+  {nullptr, "Replace:"},
+  {nullptr, "With:"},
+  {nullptr, "Bad pattern: {}"},
+  {nullptr, "Replacing... {}% (Ctrl-Q cancels)"},
+  {nullptr, "Replace failed: {}"},
+  {nullptr, "Replace cancelled."},
+  {nullptr, "Lines changed: {}."},
+  {nullptr, " Lines too long to search: {}."},
+  {"{} turotenus kêl ase!", "Invalid option: {}"},
+  {"{} turotenus kêl ases!", "Invalid options: {}"},
+  {"{} turotenus kêl ese!", "Invalid options: {}"},
+};
+
+// The text of message m, with arg in place of its {}
+std::string messageText(
+    Messages m, const std::string& arg = "", bool english = false) {
+  const MessageText& texts = messageTexts[m];
+  std::string text =
+    (english || texts.native == nullptr) ? texts.english : texts.native;
+  size_t at = text.find("{}");
+  if (at != std::string::npos) text.replace(at, 2, arg);
+  return text;
+}
+
+class Buffer {
+public:
+  LineTree lines;
+  // cursorCol can extend beyond the line length, but that
+  // is treated as the end of that line
+  size_t cursorRow = 0, cursorCol = 0;
+  size_t cursorVCol = 0;
+  size_t scrollRow = 0;
+  size_t scrollCol = 0;
+  size_t scrollVCol = 0;
+  size_t width, height;
+  bool dirty = false;
+  bool prompting = false;
+  bool first = true;
+  std::string message;
+  Line promptInput;
+  size_t promptVLength;
+  Line pastEnd;
+  size_t pastEndVLength = 0;
+  int messageColour;
+  std::string filename;
+  // Bumped on every edit, so that a save can tell whether the buffer
+  // changed after it took its snapshot
+  size_t revision = 0;
+  std::unique_ptr<SaveJob> saving;
+  UndoLog history;
+  Journal journal;
+  // How much of the journal the save in progress covers
+  size_t journalMark = 0;
+  std::unique_ptr<SearchJob> searching;
+  std::string* sink;
+  static constexpr size_t HEADLESS_WIDTH = 80;
+  static constexpr size_t HEADLESS_HEIGHT = 24;
+  // How much of a file to read before showing the first screen
+  static constexpr size_t FIRST_READ = 1 << 20;
+  // Matches of highlight are shown until the next key, and the one at
+  // (highlightRow, highlightCol) stands out.
+  std::string highlight;
+  size_t highlightRow = 0, highlightCol = 0;
+  std::string lastFind;
+  // The file the unedited lines point into
+  std::shared_ptr<MappedFile> mapping;
+  std::unique_ptr<LineLoader> loader;
+  std::unique_ptr<Follower> follower;
+  // The last line as it was when following started, if it had no
+  // newline yet. The follower carries it on only if it still reads so.
+  std::string followedTail;
+  std::unique_ptr<FileWatcher> watcher;
+  // Copies of the parts of the file read in again since, which lines
+  // point into
+  std::vector<std::shared_ptr<MappedFile>> pieces;
+  // Once pieces add up to this many bytes, the ones that are no longer
+  // needed are let go of
+  static constexpr size_t PIECES_MIN = 16 << 20;
+  size_t trimPiecesAt = PIECES_MIN;
+  // Files of at least viewThreshold() bytes, or any file if viewOnly is
+  // set, are only viewed. Then lines holds just what is on the screen,
+  // which starts windowStart bytes into the file, and pager finds out
+  // where the rest of the lines are.
+  bool viewOnly = false;
+  std::unique_ptr<LineIndex> pager;
+  size_t windowStart = 0, windowEnd = 0;
+  // The number of the first line on the screen, or SIZE_MAX if the
+  // pager has not got that far yet
+  size_t windowRow = 0;
+  // A stream that is only viewed keeps just its last viewThreshold()
+  // bytes, like the scrollback of a terminal. firstRow lines have been
+  // let go of so far, and streamBytes are kept.
+  size_t firstRow = 0;
+  size_t streamBytes = 0;
+  DHRBox box;
+  bool isDHR = false;
+  Screen screen;
+  // The scroll position of the last frame drawn
+  size_t drawnScrollRow = 0;
+  Stats stats;
+  // Were the stats shown at any point? If so, they are saved on exit.
+  bool statsShown = false;
+  // Was the user told that the file being viewed got cut short?
+  bool cutReported = false;
+  class Options {
+  public:
+    Options() :
+      boolOptions(BoolOptions::B_COUNT),
+      sizeOptions(sizeOptionDefaults, sizeOptionDefaults + S_COUNT) {}
+    bool lineno() const { return boolOptions[BoolOptions::B_LINE_NUMBERS]; }
+    bool stats() const { return boolOptions[BoolOptions::B_STATS]; }
+    bool english() const { return boolOptions[BoolOptions::B_ENGLISH]; }
+    size_t undoMemory() const { return sizeOptions[S_UNDO_MEMORY]; }
+    size_t viewThreshold() const { return sizeOptions[S_VIEW_THRESHOLD]; }
+    std::vector<bool> boolOptions;
+    std::vector<size_t> sizeOptions;
+  };
+  Options options;
+  // Frames are drawn into sink instead of the terminal if it is given,
+  // as if onto a terminal of HEADLESS_WIDTH by HEADLESS_HEIGHT.
+  explicit Buffer(std::string* sink = nullptr) : sink(sink) {
+    if (headless()) {
+      width = HEADLESS_WIDTH;
+      height = HEADLESS_HEIGHT;
+    } else {
+      getTerminalDimensions(width, height);
+    }
+    screen.resize(width, height);
+    addLineAtBack(Line());
+    // A replay runs the same way whoever's options are in place.
+    if (!headless()) readOptions();
+    history.setLimit(options.undoMemory());
+    statsShown = options.stats();
+  }
+  ~Buffer() {
+    finishSaving();
+    if (statsShown && !headless())
+      stats.dump(getHome() + "/.veneplU_dat/stats");
+    // Keep the journal around if there is still something to recover.
+    if (!dirty) journal.discard();
+  }
+  void read(const char* fname) {
+    loader.reset();
+    lines.clear();
+    pieces.clear();
+    filename = fname;
+    // Only what is viewed can be mapped; what might be edited and saved
+    // is copied.
+    struct stat st;
+    if (viewOnly || (::stat(fname, &st) == 0 &&
+        (size_t) st.st_size >= options.viewThreshold())) {
+      mapping = MappedFile::open(fname);
+      if (mapping != nullptr) {
+        pager = std::make_unique<LineIndex>(mapping);
+        showWindow(0, 0);
+        return;
+      }
+    }
+    mapping = MappedFile::copy(fname);
+    // Runs without a terminal leave no journals behind, and don't watch
+    // the file.
+    if (!headless()) {
+      journal.track(filename);
+      if (mapping != nullptr)
+        watcher = std::make_unique<FileWatcher>(filename);
+    }
+    if (mapping == nullptr) {
+      dirty = true;
+      return;
+    }
+    // Read and index just enough to fill the screen; the rest is found
+    // on another thread. Each line is just a view into the copy.
+    const char* begin = mapping->data;
+    const char* end = begin + mapping->fill(FIRST_READ);
+    if (end < begin + mapping->size) {
+      const char* nl = (const char*) memrchr(begin, '\n', end - begin);
+      end = nl == nullptr ? begin : nl + 1;
+    }
+    std::vector<LineTree::Entry> batch;
+    const char* p = indexLines(begin, end, height - 1, batch);
+    lines.insert(0, std::move(batch));
+    if (p < begin + mapping->size)
+      loader = std::make_unique<LineLoader>(mapping, p - begin);
+  }
+  // Loads whatever comes in on fd, which is not a file, in the
+  // background.
+  void readStream(int fd) {
+    loader.reset();
+    lines.clear();
+    filename.clear();
+    loader = std::make_unique<LineLoader>(fd);
+  }
+  // Offers to bring back edits to the file that were never saved.
+  void recover() {
+    if (filename.empty() || pager != nullptr) return;
+    std::vector<Journal::Entry> entries;
+    Journal::load(filename, entries);
+    if (entries.empty()) return;
+    say(M_RECOVER, 14);
+    if (!prompt() || !isTruthy(promptInput.str())) {
+      journal.discard();
+      message = "";
+      return;
+    }
+    finishLoading();
+    // The journal starts over with just the edits that could be made.
+    journal.track(filename);
+    size_t count = 0;
+    for (const auto& entry : entries) {
+      if (!canApply(entry.edit, entry.backwards)) break;
+      journal.append(entry.edit, entry.backwards);
+      apply(entry.edit, entry.backwards);
+      ++count;
+    }
+    if (count < entries.size()) {
+      say(M_PARTLY_RECOVERED, 9);
+    } else {
+      say(M_RECOVERED, 10);
+    }
+  }
+  bool loading() const {
+    return loader != nullptr;
+  }
+  bool headless() const {
+    return sink != nullptr;
+  }
+  // Rings the bell, in the frames if they go to sink
+  void bell() {
+    if (headless()) *sink += '\a';
+    else beep();
+  }
+  std::string text(Messages m, const std::string& arg = "") const {
+    return messageText(m, arg, options.english());
+  }
+  void say(Messages m, int colour, const std::string& arg = "") {
+    message = text(m, arg);
+    messageColour = colour;
+  }
+  // Keeps reading the file as it grows, until we quit.
+  void follow() {
+    if (pager != nullptr) {
+      say(M_FOLLOW_VIEWED, 9);
+      return;
+    }
+    if (mapping == nullptr) {
+      say(M_NOTHING_TO_FOLLOW, 9);
+      return;
+    }
+    // The whole copy has to be in to look at its end.
+    finishLoading();
+    // Start at the last line if it has no newline yet.
+    const char* begin = mapping->data;
+    size_t size = mapping->size;
+    size_t start = size;
+    if (size > 0 && begin[size - 1] != '\n') {
+      const char* nl = (const char*) memrchr(begin, '\n', size);
+      start = nl == nullptr ? 0 : nl + 1 - begin;
+    }
+    followedTail.assign(begin + start, size - start);
+    // The follower keeps up with the file instead.
+    watcher.reset();
+    follower = std::make_unique<Follower>(filename, start, start < size);
+    if (!follower->ok()) {
+      follower.reset();
+      say(M_CANNOT_FOLLOW, 9);
+      return;
+    }
+    // Like tail -f, start at the bottom.
+    if (!lines.empty()) goToBottom();
+  }
+  // Puts whatever the loader or the follower has found so far at the
+  // end of the buffer.
+  void adoptLoaded() {
+    if (loader != nullptr) {
+      std::vector<std::vector<LineTree::Entry>> batches;
+      bool done = loader->take(batches);
+      for (auto& batch : batches) {
+        if (viewOnly) {
+          for (const auto& entry : batch)
+            streamBytes += entry.text.length() + 1;
+        }
+        lines.insert(lines.size(), std::move(batch));
+      }
+      if (done) loader.reset();
+      if (viewOnly) trimStream();
+    }
+    // What the follower has comes after everything the loader finds.
+    if (follower != nullptr && loader == nullptr) adoptFollowed();
+  }
+  void adoptFollowed() {
+    if (follower->shrunk()) {
+      say(M_FOLLOW_SHRUNK, 9);
+    }
+    std::vector<LineTree::Entry> batch;
+    bool replaceLast;
+    follower->take(batch, replaceLast);
+    if (batch.empty()) return;
+    // Stay at the bottom if that is where we were.
+    bool pinned = !prompting && cursorRow + 1 >= lines.size();
+    if (replaceLast && !lines.empty()) {
+      // Edits to that line are kept, and the file's version of it goes
+      // below them.
+      size_t last = lines.size() - 1;
+      if (lines[last].str() == followedTail) {
+        lines[last] = std::move(batch.front().text);
+        lines.vlength(last) = batch.front().vlength;
+        batch.erase(batch.begin());
+      } else {
+        say(M_FOLLOW_EDITED, 9);
+      }
+    }
+    followedTail.clear();
+    lines.insert(lines.size(), std::move(batch));
+    if (pinned) goToBottom();
+  }
+  // Puts the cursor on the last line, at the bottom of the screen.
+  void goToBottom() {
+    cursorRow = lines.size() - 1;
+    scrollRow = cursorRow - std::min(cursorRow, height - 2);
+    cursorCol = lines[cursorRow].byteAtColumn(cursorVCol);
+    cursorVCol = lines[cursorRow].columnOf(cursorCol);
+    horizontalScrollAdjust();
+  }
+  void trimStream() {
+    size_t keep = options.viewThreshold();
+    size_t drop = 0;
+    while (streamBytes > keep && drop + 1 < lines.size()) {
+      streamBytes -= lines[drop].length() + 1;
+      ++drop;
+    }
+    if (drop == 0) return;
+    lines.erase(0, drop);
+    firstRow += drop;
+    cursorRow -= std::min(cursorRow, drop);
+    scrollRow -= std::min(scrollRow, drop);
+  }
+  bool readOnly() const {
+    return viewOnly || pager != nullptr;
+  }
+  // Is a stream still coming in?
+  bool streaming() const {
+    return loader != nullptr && loader->stream();
+  }
+  // Waits for the rest of the file to be loaded. A stream can go on for
+  // ever, so for one this only takes what has come in so far.
+  void finishLoading() {
+    if (loader == nullptr) return;
+    if (!loader->stream()) loader->wait();
+    adoptLoaded();
+  }
+  // Reports on the save in progress if it is done.
+  void reportSaved() {
+    if (saving == nullptr || !saving->done()) return;
+    saving->wait();
+    std::error_code stat = saving->result();
+    if (stat) {
+      say(M_SAVE_FAILED, 9, stat.message());
+    } else {
+      say(M_SAVED, 10);
+      // Anything typed since the snapshot still needs saving.
+      if (saving->revision == revision) dirty = false;
+      filename = saving->fname;
+      if (!headless()) {
+        journal.rebase(filename, journalMark);
+        // What we just wrote is what later changes are compared with.
+        if (follower == nullptr)
+          watcher = std::make_unique<FileWatcher>(filename);
+      }
+    }
+    saving.reset();
+  }
+  // Deals with the file having been changed by something else.
+  void checkFile() {
+    // A save in progress is about to replace the file anyway.
+    if (watcher == nullptr || saving != nullptr || prompting) return;
+    FileWatcher::Change change;
+    if (!watcher->take(change)) return;
+    // Unsaved edits stay as they are. The lines around them point into
+    // our own copy of the file, so they do not change with it.
+    if (dirty) {
+      say(M_CHANGED_ELSEWHERE, 9);
+      return;
+    }
+    reloadChanged(change);
+  }
+  void finishSaving() {
+    if (saving == nullptr) return;
+    saving->wait();
+    reportSaved();
+  }
+  void readOptions() {
+    std::ifstream fh(getHome() + "/.veneplU_dat/options");
+    if (fh.fail()) return;
+    std::string s;
+    std::vector<std::string> invalidOptions;
+    while (getline(fh, s)) {
+      size_t firstNonspace = s.find_first_not_of(WHITESPACE);
+      if (firstNonspace == std::string::npos || s[firstNonspace] == '#')
+        continue;
+      // Get the parts
+      size_t split = s.find('=');
+      std::string key = trimWhitespace(s.substr(0, split));
+      std::string value = trimWhitespace(s.substr(split + 1));
+      auto it1 = boolOptionsByName.find(key);
+      auto it2 = sizeOptionsByName.find(key);
+      if (it1 != boolOptionsByName.end()) {
+        size_t index = it1->second;
+        options.boolOptions[index] = isTruthy(value);
+      } else if (it2 != sizeOptionsByName.end() &&
+          parseSize(value, options.sizeOptions[it2->second])) {
+        // Nothing else to do
+      } else {
+        // invalid option
+        invalidOptions.push_back(key);
+      }
+    }
+    if (!invalidOptions.empty()) {
+      std::string names;
+      for (const std::string& opt : invalidOptions) {
+        if (!names.empty()) names += ' ';
+        names += '"';
+        names += opt;
+        names += '"';
+      }
+      say(
+        (invalidOptions.size() == 1) ? M_BAD_OPTION :
+        (invalidOptions.size() == 2) ? M_BAD_OPTIONS_2 : M_BAD_OPTIONS,
+        9, names);
+    }
+  }
+  void draw() {
+    auto start = Stats::Clock::now();
+    resizeIfNecessary();
+    if (pager != nullptr && windowRow == SIZE_MAX)
+      windowRow = pager->rowOf(windowStart);
+    // Say why the text has gone blank, once, when nothing else is being
+    // said. The tail of the last page left reads as NULs without any
+    // SIGBUS, so the file's size is looked at too.
+    if (pager != nullptr && !cutReported && !prompting && message.empty()) {
+      struct stat st;
+      if (mapping->cut() || (::stat(filename.c_str(), &st) == 0 &&
+          (size_t) st.st_size < mapping->size)) {
+        cutReported = true;
+        say(M_VIEW_CUT, 9);
+      }
+    }
+    screen.clear();
+    if (scrollRow != drawnScrollRow && height > 1)
+      screen.scroll(0, height - 2, (long) scrollRow - (long) drawnScrollRow);
+    drawnScrollRow = scrollRow;
+    size_t gutter = options.lineno() ? 6 : 0;
+    size_t lineno = scrollRow;
+    // Draw each line.
+    for (size_t row = 0; row + 1 < height; ++row, ++lineno) {
+      if (lineno >= lines.size()) {
+        drawBlank(row, lineno);
+      } else {
+        drawLineNo(row, lineno);
+        // Only the cursor's line is scrolled sideways.
+        size_t start = (lineno == cursorRow) ? scrollCol : 0;
+        drawLine(lines[lineno], row, gutter, start, lineno);
+      }
+    }
+    size_t statusRow = height - 1;
+    if (prompting) {
+      size_t col = drawMessage(statusRow);
+      drawLine(promptInput, statusRow, col + 2, scrollCol);
+    } else if (message.empty() && options.stats()) {
+      screen.print(statusRow, 0, stats.summary(), colour(6) | A_BOLD);
+    } else if (message.empty()) {
+      // Info about the buffer.
+      size_t col = screen.print(statusRow, 0, "veneplū", colour(2) | A_BOLD);
+      col = screen.print(statusRow, col, " - ");
+      if (filename != "") {
+        col = screen.print(statusRow, col, filename, colour(5) | A_BOLD);
+        if (dirty)
+          col = screen.print(statusRow, col, "*", colour(1) | A_BOLD);
+      } else if (!readOnly()) {
+        col = screen.print(statusRow, col, "*", colour(1) | A_BOLD);
+      }
+      if (readOnly()) {
+        col = screen.print(statusRow, col,
+          (filename.empty() ? "" : " ") + text(M_VIEWING),
+          colour(3) | A_BOLD);
+      }
+      // Either can be SIZE_MAX when viewing, if the pager has not got
+      // that far yet.
+      size_t total = firstRow + lines.size(), row = firstRow + cursorRow;
+      if (pager != nullptr) {
+        total = pager->lineCount();
+        row = windowRow == SIZE_MAX ? SIZE_MAX : windowRow + cursorRow;
+      }
+      std::string info = " ";
+      info += (total == SIZE_MAX ? "?" : toString(total)) + " v";
+      info +=
+        (total == 1) ? 'a' : 'e';
+      info += "tál ";
+      col = screen.print(statusRow, col, info, colour(6) | A_BOLD);
+      size_t permille = loading() ? loader->progress() :
+        pager != nullptr && !pager->complete() ? pager->progress() : SIZE_MAX;
+      if (permille != SIZE_MAX) {
+        std::string progress = std::to_string(permille / 10);
+        progress += "% ";
+        col = screen.print(statusRow, col, progress, colour(3) | A_BOLD);
+      }
+      info = row == SIZE_MAX ? "?" : toString(row + 1);
+      info +=
+        (row == 0) ? "ma" :
+        (row == 1) ? "mu" : "ru";
+      info += " | ";
+      info += toString(cursorVCol + 1);
+      info +=
+        (cursorVCol == 0) ? "ma" :
+        (cursorVCol == 1) ? "mu" : "ru";
+      info += " vżama";
+      col = screen.print(statusRow, col, info, colour(6) | A_BOLD);
+      if (isDHR) {
+        std::string dhr = " Ḋ[";
+        dhr += box.upper ? 'K' : 'k';
+        dhr +=
+          box.forceStress ? "ûú" :
+          box.forceUnstress ? "ūu" : "ûu";
+        dhr += "]";
+        col = screen.print(statusRow, col, dhr, colour(3) | A_BOLD);
+      }
+    } else {
+      drawMessage(statusRow);
+    }
+    // Work out where the cursor goes.
+    size_t vlength = currentVLength();
+    size_t cursorScreenCol = std::min(cursorVCol, vlength) - scrollVCol;
+    size_t cursorScreenRow;
+    if (prompting) {
+      cursorScreenRow = statusRow;
+      cursorScreenCol += width - actualWidth();
+    } else {
+      cursorScreenRow = cursorRow - scrollRow;
+      cursorScreenCol += gutter;
+    }
+    // Finally, send over whatever changed.
+    std::string output;
+    screen.render(output, cursorScreenRow, cursorScreenCol);
+    stats.record(Stats::DRAW, start);
+    stats.recordFrame(output.length());
+    start = Stats::Clock::now();
+    if (headless()) sink->append(output);
+    else writeTerminal(output);
+    stats.record(Stats::WRITE, start);
+  }
+  void react(int keycode) {
+    if (!first) message = "";
+    else first = false;
+    highlight.clear();
+    if (pager != nullptr) {
+      view(keycode);
+      return;
+    }
+    if (viewOnly && changesText(keycode)) {
+      say(M_VIEW_ONLY, 9);
+      return;
+    }
+    if (isDHR && keycode >= 0) {
+      keycode = box.feed(keycode);
+      if (keycode <= 0) {
+        if (keycode == 0) bell();
+        keycode = SpecialKeys::UNKNOWN;
+      }
+    }
+    // Moving the cursor ends a run of typing as far as undo goes.
+    if (keycode == SpecialKeys::LEFT || keycode == SpecialKeys::RIGHT ||
+        keycode == SpecialKeys::UP || keycode == SpecialKeys::DOWN ||
+        keycode == SpecialKeys::PAGE_UP || keycode == SpecialKeys::PAGE_DOWN ||
+        keycode == SpecialKeys::HOME || keycode == SpecialKeys::END ||
+        keycode == SpecialKeys::GOTO)
+      history.seal();
+    switch (keycode) {
+      case SpecialKeys::LEFT: left(); break;
+      case SpecialKeys::RIGHT: right(); break;
+      case SpecialKeys::UP: up(); break;
+      case SpecialKeys::DOWN: down(); break;
+      case SpecialKeys::PAGE_UP: moveRows(-(long) (height - 1)); break;
+      case SpecialKeys::PAGE_DOWN: moveRows(height - 1); break;
+      case SpecialKeys::HOME: cursorCol = cursorVCol = 0; break;
+      case SpecialKeys::END:
+        cursorCol = currentLine().length();
+        cursorVCol = currentVLength();
+        break;
+      case SpecialKeys::GOTO: goTo(); break;
+      case SpecialKeys::BACKSPACE: backspace(); break;
+      case SpecialKeys::DELETE: del(); break;
+      case SpecialKeys::ENTER: insertNewLine(); break;
+      case SpecialKeys::SAVE: saveIntractive(); break;
+      case SpecialKeys::SAVE_AS: saveIntractive(true); break;
+      case SpecialKeys::DHR_MODE: isDHR = !isDHR; box.reset(); break;
+      case SpecialKeys::PASTE: insertText(keyboard.pasted); break;
+      case SpecialKeys::UNDO: undo(); break;
+      case SpecialKeys::REDO: redo(); break;
+      case SpecialKeys::FIND: find(); break;
+      case SpecialKeys::REPLACE: replaceAll(); break;
+      case SpecialKeys::STATS: toggleStats(); break;
+      case SpecialKeys::RESET: bell(); break;
+      case SpecialKeys::QUIT: break;
+      case SpecialKeys::COPY: break;
+      case SpecialKeys::UNKNOWN: break;
+      default: insert(keycode);
+    }
+    horizontalScrollAdjust();
+  }
+private:
+  // Reads in the part of the file that changed, leaving the lines before
+  // and after it as they are.
+  void reloadChanged(const FileWatcher::Change& change) {
+    finishLoading();
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      say(M_REMOVED_ELSEWHERE, 9);
+      return;
+    }
+    // If the file changed again since, or the buffer is not what we
+    // think it is, read it all again.
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size != change.newSize ||
+        lines.size() != change.oldLines) {
+      close(fd);
+      reloadAll();
+      return;
+    }
+    // The old lines point at where the unchanged end used to be. If the
+    // file was written over and got longer or shorter, that is not
+    // there any more.
+    size_t kept = change.replaced || change.newSize == change.oldSize ?
+      change.suffix : 0;
+    // Start from the line the change starts in...
+    size_t from = lineStart(fd, change.prefix);
+    size_t firstRow = change.prefixNewlines;
+    // ...and go up to the first whole line in the unchanged end.
+    size_t to = change.newSize, endRow = lines.size();
+    if (kept > 0) {
+      size_t nl = nextNewline(fd, change.newSize - kept, change.newSize);
+      if (nl != SIZE_MAX) {
+        to = nl + 1;
+        endRow = change.oldNewlines - (change.suffixNewlines - 1);
+      }
+    }
+    close(fd);
+    // Only that much is read in, into a copy of its own.
+    std::shared_ptr<MappedFile> piece = from == SIZE_MAX ? nullptr :
+      MappedFile::copy(filename.c_str(), from, to - from);
+    if (piece == nullptr || piece->size != to - from) {
+      reloadAll();
+      return;
+    }
+    piece->fill(piece->size);
+    std::vector<LineTree::Entry> batch;
+    indexLines(piece->data, piece->data + piece->size, SIZE_MAX, batch);
+    size_t added = batch.size();
+    lines.erase(firstRow, endRow);
+    lines.insert(firstRow, std::move(batch));
+    pieces.push_back(std::move(piece));
+    trimPieces();
+    // Keep the cursor on the same text if it was below the change.
+    if (cursorRow >= endRow) cursorRow += firstRow + added - endRow;
+    if (scrollRow >= endRow) scrollRow += firstRow + added - endRow;
+    moveRows(0);
+    // Edits from before no longer line up with the text.
+    history.clear();
+    journal.track(filename);
+    say(M_RELOADED, 10, toString(added));
+  }
+  // Lets go of the pieces that no line points into any more. The lines
+  // left in a piece that is mostly unused are copied out of it first.
+  void trimPieces() {
+    size_t held = 0;
+    for (const auto& piece : pieces) held += piece->size;
+    if (held < trimPiecesAt) return;
+    // The pieces in the order they are in memory, to look lines up in
+    std::vector<size_t> order(pieces.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return pieces[a]->data < pieces[b]->data;
+    });
+    auto pieceOf = [&](const Line& line) {
+      if (!line.isView()) return SIZE_MAX;
+      const char* p = line.run(0).first;
+      auto it = std::upper_bound(order.begin(), order.end(), p,
+        [&](const char* q, size_t i) { return q < pieces[i]->data; });
+      if (it == order.begin()) return SIZE_MAX;
+      const MappedFile& piece = *pieces[*(it - 1)];
+      // An empty last line points right past the end.
+      return p <= piece.data + piece.size ? *(it - 1) : SIZE_MAX;
+    };
+    std::vector<size_t> used(pieces.size());
+    lines.forEach([&](const Line& line) {
+      size_t i = pieceOf(line);
+      if (i != SIZE_MAX) used[i] += line.length() + 1;
+    });
+    std::vector<bool> dropped(pieces.size());
+    for (size_t i = 0; i < pieces.size(); ++i)
+      dropped[i] = used[i] < pieces[i]->size / 4;
+    std::vector<size_t> rows;
+    lines.forEachFrom(0, [&](size_t r, const Line& line) {
+      size_t i = pieceOf(line);
+      if (i != SIZE_MAX && dropped[i]) rows.push_back(r);
+      return true;
+    });
+    for (size_t r : rows) lines[r] = Line(lines[r].str());
+    size_t kept = 0;
+    held = 0;
+    for (size_t i = 0; i < pieces.size(); ++i) {
+      if (dropped[i]) continue;
+      held += pieces[i]->size;
+      pieces[kept++] = std::move(pieces[i]);
+    }
+    pieces.resize(kept);
+    trimPiecesAt = std::max(PIECES_MIN, 2 * held);
+  }
+  void reloadAll() {
+    std::string name = filename;
+    size_t row = cursorRow;
+    read(name.c_str());
+    finishLoading();
+    cursorRow = row;
+    moveRows(0);
+    history.clear();
+  }
+  // Keys while viewing. Nothing can be changed, but the screen can be
+  // moved anywhere in the file.
+  void view(int keycode) {
+    long page = height - 1;
+    switch (keycode) {
+      case SpecialKeys::UP:
+        if (cursorRow > 0) up();
+        else scrollWindow(-1);
+        break;
+      case SpecialKeys::DOWN:
+        if (cursorRow + 1 < lines.size()) down();
+        else scrollWindow(1);
+        break;
+      case SpecialKeys::LEFT:
+        if (cursorCol > 0 || cursorRow > 0) left();
+        break;
+      case SpecialKeys::RIGHT:
+        if (cursorCol < currentLine().length() || cursorRow + 1 < lines.size())
+          right();
+        break;
+      case SpecialKeys::PAGE_UP:
+        if (windowStart == 0) cursorRow = 0;
+        scrollWindow(-page);
+        break;
+      case SpecialKeys::PAGE_DOWN:
+        scrollWindow(page);
+        if (windowEnd == mapping->size) cursorRow = lines.size() - 1;
+        break;
+      case SpecialKeys::HOME:
+        cursorRow = 0;
+        showWindow(0, 0);
+        break;
+      case SpecialKeys::END: showEnd(); break;
+      case SpecialKeys::GOTO: goTo(); break;
+      case SpecialKeys::STATS: toggleStats(); break;
+      case SpecialKeys::QUIT: break;
+      case SpecialKeys::UNKNOWN: break;
+      default:
+        say(M_VIEW_ONLY, 9);
+    }
+    horizontalScrollAdjust();
+  }
+  static bool changesText(int keycode) {
+    switch (keycode) {
+      case SpecialKeys::BACKSPACE: case SpecialKeys::DELETE:
+      case SpecialKeys::ENTER: case SpecialKeys::PASTE:
+      case SpecialKeys::UNDO: case SpecialKeys::REDO:
+      case SpecialKeys::REPLACE: case SpecialKeys::SAVE:
+      case SpecialKeys::SAVE_AS:
+        return true;
+      default:
+        return keycode >= 0;
+    }
+  }
+  // Shows a screenful of the file from byte start, which is where line
+  // row begins.
+  void showWindow(size_t start, size_t row) {
+    windowStart = start;
+    windowRow = row;
+    fillWindow();
+  }
+  void showEnd() {
+    size_t start = mapping->size;
+    for (size_t i = 0; i + 1 < height && start > 0; ++i)
+      start = lineBefore(start);
+    showWindow(start, pager->rowOf(start));
+    cursorRow = lines.size() - 1;
+  }
+  void fillWindow() {
+    const char* begin = mapping->data;
+    const char* end = begin + mapping->size;
+    std::vector<LineTree::Entry> batch;
+    windowEnd = indexLines(begin + windowStart, end, height - 1, batch) -
+      begin;
+    if (batch.empty()) batch.push_back({Line(), 0});
+    lines.clear();
+    lines.insert(0, std::move(batch));
+    cursorRow = std::min(cursorRow, lines.size() - 1);
+    cursorCol = lines[cursorRow].byteAtColumn(cursorVCol);
+    cursorVCol = lines[cursorRow].columnOf(cursorCol);
+  }
+  // Moves the screen down delta lines, or up if it is negative, as far
+  // as the file goes.
+  void scrollWindow(long delta) {
+    for (; delta > 0 && windowEnd < mapping->size; --delta) {
+      windowStart = lineAfter(windowStart);
+      windowEnd = lineAfter(windowEnd);
+      if (windowRow != SIZE_MAX) ++windowRow;
+    }
+    for (; delta < 0 && windowStart > 0; ++delta) {
+      windowStart = lineBefore(windowStart);
+      if (windowRow != SIZE_MAX) --windowRow;
+    }
+    fillWindow();
+  }
+  // Where the line after the one starting at offset starts
+  size_t lineAfter(size_t offset) const {
+    const char* begin = mapping->data;
+    const char* nl = (const char*) memchr(begin + offset, '\n',
+      mapping->size - offset);
+    return nl == nullptr ? mapping->size : nl + 1 - begin;
+  }
+  // Where the line before the one starting at offset starts
+  size_t lineBefore(size_t offset) const {
+    const char* begin = mapping->data;
+    // Skip the newline that ends that line, if it has one.
+    size_t n = offset - (begin[offset - 1] == '\n' ? 1 : 0);
+    const char* nl = (const char*) memrchr(begin, '\n', n);
+    return nl == nullptr ? 0 : nl + 1 - begin;
+  }
+  // Moves the cursor delta rows, and the screen along with it.
+  void moveRows(long delta) {
+    size_t row = delta < 0 ?
+      cursorRow - std::min<size_t>(cursorRow, -delta) :
+      std::min<size_t>(cursorRow + delta, lastRow());
+    if (row < cursorRow) scrollRow -= std::min(scrollRow, cursorRow - row);
+    else scrollRow += row - cursorRow;
+    cursorRow = row;
+    // Don't go so far that the last page is not full.
+    size_t lastPage = lastRow() - std::min(lastRow(), height - 2);
+    scrollRow = std::min(scrollRow, lastPage);
+    scrollRow = std::min(scrollRow, cursorRow);
+    if (cursorRow >= scrollRow + height - 1)
+      scrollRow = cursorRow - (height - 2);
+    if (cursorRow < lines.size()) {
+      cursorCol = lines[cursorRow].byteAtColumn(cursorVCol);
+      cursorVCol = lines[cursorRow].columnOf(cursorCol);
+    } else {
+      cursorCol = 0;
+      cursorVCol = 0;
+    }
+  }
+  // Asks for a line number, in dozenal like the ones shown, and goes
+  // there.
+  void goTo() {
+    say(M_GO_TO, 14);
+    bool accepted = prompt();
+    message = "";
+    if (!accepted || promptInput.empty()) return;
+    size_t n;
+    if (!parseDozenal(promptInput.str(), n) || n == 0) {
+      say(M_NOT_A_LINE, 9);
+      return;
+    }
+    size_t row = n - 1;
+    if (pager != nullptr) {
+      size_t offset = pager->offsetOf(row);
+      if (offset == SIZE_MAX) {
+        say(M_TOO_FEW_LINES, 9);
+        return;
+      }
+      cursorRow = 0;
+      showWindow(offset, row);
+      return;
+    }
+    finishLoading();
+    if (row < firstRow) {
+      say(M_LINE_GONE, 9);
+      return;
+    }
+    cursorRow = std::min(row - firstRow, lastRow());
+    scrollRow = cursorRow - std::min(cursorRow, (height - 1) / 2);
+    moveRows(0);
+  }
+  void toggleStats() {
+    options.boolOptions[BoolOptions::B_STATS] = !options.stats();
+    statsShown = statsShown || options.stats();
+  }
+  void touch() {
+    dirty = true;
+    ++revision;
+  }
+  size_t actualWidth() const {
+    size_t xoff = 0;
+    if (prompting) xoff = wcswidthp(message) + 2;
+    else if (options.lineno()) xoff = 6;
+    return width - xoff;
+  }
+  void left() {
+    auto& line = currentLine();
+    auto& vlength = currentVLength();
     cursorCol = std::min(cursorCol, line.length());
     cursorVCol = std::min(cursorVCol, vlength);
     if (cursorCol > 0) {
@@ -688,21 +4696,10 @@ private:
     } else if (cursorRow > 0 && !prompting) {
       --cursorRow;
       cursorCol = lines[cursorRow].length();
-      cursorVCol = vlengths[cursorRow];
-      scrollCol = cursorCol;
-      scrollVCol = cursorVCol;
-      // Get the earliest character that we can anchor to
-      UTF8Iterator it(lines[cursorRow], cursorCol);
-      size_t nReceded = 0;
-      while (nReceded < actualWidth()) {
-        --it;
-        int codepoint = it.get();
-        size_t gw = wcwidthp(codepoint);
-        nReceded += gw;
-        if (it.position() == 0) break;
-      }
-      scrollCol = it.position();
-      scrollVCol -= nReceded;
+      cursorVCol = lines.vlength(cursorRow);
+      scrollCol = 0;
+      scrollVCol = 0;
+      horizontalScrollAdjust();
     }
     // Out of bounds?
     if (cursorRow < scrollRow) {
@@ -710,23 +4707,17 @@ private:
     }
   }
   void right() {
-    if (cursorRow == lines.size()) return;
-    auto& line = prompting ? promptInput : lines[cursorRow];
-    auto& vlength = prompting ? promptVLength : vlengths[cursorRow];
+    if (!prompting && cursorRow == lines.size()) return;
+    auto& line = currentLine();
+    auto& vlength = currentVLength();
     cursorCol = std::min(cursorCol, line.length());
     cursorVCol = std::min(cursorVCol, vlength);
     if (cursorCol < line.length()) {
-      size_t old = cursorCol;
       UTF8Iterator it(line, cursorCol);
       int codepoint = it.getAndAdvance();
       cursorCol = it.position();
-      size_t gw = wcwidthp(codepoint);
-      cursorVCol += gw;
-      if (cursorVCol >= scrollVCol + actualWidth()) {
-        scrollVCol += gw;
-        scrollCol += cursorCol - old;
-      }
-    } else if (cursorRow < lines.size() && !prompting) {
+      cursorVCol += wcwidthp(codepoint);
+    } else if (cursorRow < lastRow() && !prompting) {
       ++cursorRow;
       cursorCol = 0;
       cursorVCol = 0;
@@ -740,31 +4731,37 @@ private:
     }
   }
   void horizontalScrollAdjust() {
+    auto& line = currentLine();
+    cursorCol = std::min(cursorCol, line.length());
+    cursorVCol = std::min(cursorVCol, currentVLength());
     if (cursorCol < scrollCol) {
       scrollCol = cursorCol;
       scrollVCol = cursorVCol;
     }
-    if (cursorVCol >= scrollVCol + actualWidth()) {
+    // The last column is left for the $ on lines that go on.
+    size_t visible = actualWidth() - 1;
+    if (cursorVCol >= scrollVCol + visible) {
       // Get the earliest character that we can anchor to
-      UTF8Iterator it(lines[cursorRow], cursorCol);
+      size_t position = cursorCol;
       size_t nReceded = 0;
-      while (nReceded < actualWidth()) {
+      while (position > 0) {
+        UTF8Iterator it(line, position);
         --it;
-        int codepoint = it.get();
-        size_t gw = wcwidthp(codepoint);
+        size_t gw = wcwidthp(it.get());
+        if (nReceded + gw >= visible) break;
         nReceded += gw;
-        if (it.position() == 0) break;
+        position = it.position();
       }
-      scrollCol = it.position();
-      scrollVCol -= nReceded;
+      scrollCol = position;
+      scrollVCol = cursorVCol - nReceded;
     }
   }
   // The following two methods are not used in prompts.
   void up() {
     if (cursorRow > 0) {
       --cursorRow;
-      cursorCol = unwcswidthp(lines[cursorRow], cursorVCol);
-      cursorVCol = wcswidthp(lines[cursorRow], cursorCol);
+      cursorCol = lines[cursorRow].byteAtColumn(cursorVCol);
+      cursorVCol = lines[cursorRow].columnOf(cursorCol);
     }
     // Out of bounds?
     if (cursorRow < scrollRow) {
@@ -773,11 +4770,11 @@ private:
     horizontalScrollAdjust();
   }
   void down() {
-    if (cursorRow < lines.size()) {
+    if (cursorRow < lastRow()) {
       ++cursorRow;
       if (cursorRow < lines.size()) {
-        cursorCol = unwcswidthp(lines[cursorRow], cursorVCol);
-        cursorVCol = wcswidthp(lines[cursorRow], cursorCol);
+        cursorCol = lines[cursorRow].byteAtColumn(cursorVCol);
+        cursorVCol = lines[cursorRow].columnOf(cursorCol);
       } else {
         cursorCol = 0;
         cursorVCol = 0;
@@ -790,30 +4787,36 @@ private:
     horizontalScrollAdjust();
   }
   void del() {
-    auto& line = prompting ? promptInput : lines[cursorRow];
-    auto& vlength = prompting ? promptVLength : vlengths[cursorRow];
+    auto& line = currentLine();
+    auto& vlength = currentVLength();
     cursorCol = std::min(cursorCol, line.length());
     cursorVCol = std::min(cursorVCol, vlength);
     if (cursorCol < line.length()) {
       UTF8Iterator it(line, cursorCol);
       int codepoint = it.getAndAdvance();
       int length = it.position() - cursorCol;
+      if (!prompting) {
+        recordEdit({cursorRow, cursorCol,
+          line.str(cursorCol, length), "", Edit::DELETE});
+      }
       line.erase(cursorCol, length);
       vlength -= wcwidthp(codepoint);
       // Possibility of non-UTF-8 bytes merging into UTF-8 codepoints
       if (codepoint < 0)
-        cursorVCol = wcswidthp(line, cursorCol);
-      if (!prompting) dirty = true;
-    } else if (cursorRow < lines.size() - 1 && !prompting) {
+        cursorVCol = line.columnOf(cursorCol);
+      if (!prompting) touch();
+    } else if (cursorRow + 1 < lines.size() && !prompting) {
+      recordEdit({cursorRow, cursorCol, "\n", "", Edit::DELETE});
       // Merge the two lines
-      lines[cursorRow] += lines[cursorRow + 1];
-      vlengths[cursorRow] += vlengths[cursorRow + 1];
-      lines.erase(lines.begin() + cursorRow + 1);
+      lines[cursorRow].append(std::move(lines[cursorRow + 1]));
+      lines.vlength(cursorRow) += lines.vlength(cursorRow + 1);
+      lines.erase(cursorRow + 1);
+      touch();
     }
   }
   void backspace() {
-    auto& line = prompting ? promptInput : lines[cursorRow];
-    auto& vlength = prompting ? promptVLength : vlengths[cursorRow];
+    auto& line = currentLine();
+    auto& vlength = currentVLength();
     cursorCol = std::min(cursorCol, line.length());
     cursorVCol = std::min(cursorVCol, vlength);
     if (cursorCol > 0) {
@@ -822,280 +4825,742 @@ private:
       cursorCol = it.position();
       int codepoint = it.getAndAdvance();
       int length = it.position() - cursorCol;
+      if (!prompting) {
+        recordEdit({cursorRow, cursorCol,
+          line.str(cursorCol, length), "", Edit::BACKSPACE});
+      }
       cursorVCol -= wcwidthp(codepoint);
       line.erase(cursorCol, length);
       vlength -= wcwidthp(codepoint);
       // Possibility of non-UTF-8 bytes merging into UTF-8 codepoints
       if (codepoint < 0)
-        cursorVCol = wcswidthp(line, cursorCol);
-      if (!prompting) dirty = true;
+        cursorVCol = line.columnOf(cursorCol);
+      if (!prompting) touch();
     } else if (cursorRow > 0 && !prompting) {
       // Merge the two lines
       --cursorRow;
       cursorCol = lines[cursorRow].length();
-      cursorVCol = vlengths[cursorRow];
-      lines[cursorRow] += lines[cursorRow + 1];
-      vlengths[cursorRow] += vlengths[cursorRow + 1];
-      lines.erase(lines.begin() + cursorRow + 1);
-      dirty = true;
+      cursorVCol = lines.vlength(cursorRow);
+      // The row past the last line has nothing to merge
+      if (cursorRow + 1 < lines.size()) {
+        recordEdit({cursorRow, cursorCol, "\n", "", Edit::BACKSPACE});
+        lines[cursorRow].append(std::move(lines[cursorRow + 1]));
+        lines.vlength(cursorRow) += lines.vlength(cursorRow + 1);
+        lines.erase(cursorRow + 1);
+        touch();
+      }
     }
   }
   void insert(int codepoint) {
     // non-newline case
-    if (!prompting && cursorRow == lines.size()) {
-      addLineAtBack("");
+    bool newRow = !prompting && cursorRow == lines.size();
+    if (newRow) {
+      addLineAtBack(Line());
     }
-    auto& line = prompting ? promptInput : lines[cursorRow];
-    auto& vlength = prompting ? promptVLength : vlengths[cursorRow];
+    auto& line = currentLine();
+    auto& vlength = currentVLength();
     cursorCol = std::min(cursorCol, line.length());
     cursorVCol = std::min(cursorVCol, vlength);
     std::string insertion = utf8CodepointToChar(codepoint);
+    if (!prompting) {
+      recordEdit({cursorRow, cursorCol,
+        "", insertion, Edit::TYPING, newRow});
+    }
     line.insert(cursorCol, insertion);
     cursorCol += insertion.length();
     cursorVCol += wcwidthp(codepoint);
     vlength += wcwidthp(codepoint);
     // Possibility of non-UTF-8 bytes merging into UTF-8 codepoints
     if (codepoint < 0)
-      cursorVCol = wcswidthp(line, cursorCol);
-    if (!prompting) dirty = true;
+      cursorVCol = line.columnOf(cursorCol);
+    if (!prompting) touch();
+  }
+  // Inserts a whole block of text at the cursor in one splice.
+  // Only the first line is used in prompts.
+  void insertText(const std::string& text) {
+    // Terminals tend to send line breaks as carriage returns.
+    std::vector<std::string> pieces;
+    size_t start = 0;
+    while (true) {
+      size_t end = text.find_first_of("\r\n", start);
+      if (end == std::string::npos || prompting) {
+        pieces.push_back(text.substr(start, end - start));
+        break;
+      }
+      pieces.push_back(text.substr(start, end - start));
+      start = end + 1;
+      if (text[end] == '\r' && start < text.length() && text[start] == '\n')
+        ++start;
+    }
+    bool newRow = !prompting && cursorRow == lines.size();
+    if (newRow) {
+      addLineAtBack(Line());
+    }
+    if (!prompting) {
+      cursorCol = std::min(cursorCol, lines[cursorRow].length());
+      std::string joined = pieces[0];
+      for (size_t i = 1; i < pieces.size(); ++i) {
+        joined += '\n';
+        joined += pieces[i];
+      }
+      recordEdit({cursorRow, cursorCol,
+        "", std::move(joined), Edit::OTHER, newRow});
+    }
+    insertPieces(pieces);
+    if (!prompting) touch();
+  }
+  // Puts pieces in at the cursor as consecutive lines, and leaves the
+  // cursor after them.
+  void insertPieces(const std::vector<std::string>& pieces) {
+    auto& line = currentLine();
+    auto& vlength = currentVLength();
+    cursorCol = std::min(cursorCol, line.length());
+    cursorVCol = std::min(cursorVCol, vlength);
+    if (pieces.size() == 1) {
+      size_t w = wcswidthp(pieces[0]);
+      line.insert(cursorCol, pieces[0]);
+      cursorCol += pieces[0].length();
+      cursorVCol += w;
+      vlength += w;
+    } else {
+      // Whatever was after the cursor ends up after the last piece.
+      Line rest = line.substr(cursorCol);
+      size_t restVLength = vlength - cursorVCol;
+      line.erase(cursorCol);
+      line.insert(cursorCol, pieces[0]);
+      vlength = cursorVCol + wcswidthp(pieces[0]);
+      std::vector<LineTree::Entry> added;
+      added.reserve(pieces.size() - 1);
+      for (size_t i = 1; i + 1 < pieces.size(); ++i) {
+        size_t w = wcswidthp(pieces[i]);
+        added.push_back({Line(pieces[i]), w});
+      }
+      const std::string& lastPiece = pieces.back();
+      Line last(lastPiece);
+      last.append(rest);
+      size_t lastVLength = wcswidthp(lastPiece);
+      added.push_back({std::move(last), lastVLength + restVLength});
+      lines.insert(cursorRow + 1, std::move(added));
+      cursorRow += pieces.size() - 1;
+      cursorCol = lastPiece.length();
+      cursorVCol = lastVLength;
+      if (cursorRow >= scrollRow + height - 1)
+        scrollRow = cursorRow - (height - 2);
+    }
   }
   // Not used in prompts.
   void insertNewLine() {
     if (cursorRow == lines.size()) {
-      addLineAtBack("");
+      recordEdit({cursorRow, 0, "", "", Edit::OTHER, true});
+      addLineAtBack(Line());
     } else {
+      cursorCol = std::min(cursorCol, lines[cursorRow].length());
+      cursorVCol = std::min(cursorVCol, lines.vlength(cursorRow));
+      recordEdit({cursorRow, cursorCol, "", "\n"});
       // Split the line in two. Anything after the cursor gets moved
       // to another line.
       addLineAt(lines[cursorRow].substr(cursorCol), cursorRow + 1);
       lines[cursorRow].erase(cursorCol);
-      vlengths[cursorRow] = cursorVCol;
+      lines.vlength(cursorRow) = cursorVCol;
       ++cursorRow;
       cursorCol = 0;
       cursorVCol = 0;
     }
-    dirty = true;
+    touch();
+  }
+  void undo() {
+    const Edit* e = history.undo();
+    if (e == nullptr) {
+      bell();
+      return;
+    }
+    journal.append(*e, true);
+    apply(*e, true);
+  }
+  void redo() {
+    const Edit* e = history.redo();
+    if (e == nullptr) {
+      bell();
+      return;
+    }
+    journal.append(*e, false);
+    apply(*e, false);
+  }
+  void recordEdit(Edit&& e) {
+    journal.append(e, false);
+    history.record(std::move(e));
+  }
+  // Makes an edit again, or undoes it if backwards is set.
+  void apply(const Edit& e, bool backwards) {
+    if (!e.parts.empty()) {
+      if (backwards) {
+        for (auto it = e.parts.rbegin(); it != e.parts.rend(); ++it)
+          apply(*it, true);
+      } else {
+        for (const Edit& part : e.parts) apply(part, false);
+      }
+      return;
+    }
+    if (backwards) {
+      replaceText(e.row, e.col, e.inserted, e.removed);
+      if (e.newRow) {
+        lines.erase(e.row);
+        cursorRow = e.row;
+        cursorCol = 0;
+        cursorVCol = 0;
+      }
+    } else {
+      if (e.newRow) addLineAtBack(Line());
+      replaceText(e.row, e.col, e.removed, e.inserted);
+    }
+    touch();
+  }
+  // Could apply(e, backwards) be done on the buffer as it is?
+  bool canApply(const Edit& e, bool backwards) const {
+    const std::string& old = backwards ? e.inserted : e.removed;
+    if (e.newRow && !backwards)
+      return e.row == lines.size() && e.col == 0 && old.empty();
+    if (e.newRow && e.row + 1 != lines.size()) return false;
+    size_t row = e.row, col = e.col, start = 0;
+    while (true) {
+      if (row >= lines.size()) return false;
+      const Line& line = lines[row];
+      size_t end = old.find('\n', start);
+      size_t n = (end == std::string::npos ? old.length() : end) - start;
+      if (col > line.length() || line.length() - col < n ||
+          line.str(col, n) != old.substr(start, n))
+        return false;
+      if (end == std::string::npos) return true;
+      // The line has to end where the line break is.
+      if (col + n != line.length()) return false;
+      ++row;
+      col = 0;
+      start = end + 1;
+    }
   }
-  void addLineAtBack(const std::string& s) {
-    lines.push_back(s);
-    vlengths.push_back(wcswidthp(s));
+  // Takes out old, which has to be at (row, col), puts text in its
+  // place and leaves the cursor after it.
+  void replaceText(size_t row, size_t col,
+      const std::string& old, const std::string& text) {
+    size_t breaks = std::count(old.begin(), old.end(), '\n');
+    size_t lastLength = breaks == 0 ?
+      old.length() : old.length() - old.rfind('\n') - 1;
+    if (breaks == 0) {
+      lines[row].erase(col, lastLength);
+    } else {
+      Line rest = lines[row + breaks].substr(lastLength);
+      lines[row].erase(col);
+      lines[row].append(std::move(rest));
+      lines.erase(row + 1, row + breaks + 1);
+    }
+    cursorRow = row;
+    cursorCol = col;
+    cursorVCol = lines[row].columnOf(col);
+    std::vector<std::string> pieces;
+    size_t start = 0;
+    while (true) {
+      size_t end = text.find('\n', start);
+      pieces.push_back(text.substr(start, end - start));
+      if (end == std::string::npos) break;
+      start = end + 1;
+    }
+    insertPieces(pieces);
+    // Bytes that were malformed on their own might have come together.
+    lines.vlength(row) = lines[row].columnOf(lines[row].length());
+    lines.vlength(cursorRow) =
+      lines[cursorRow].columnOf(lines[cursorRow].length());
+    cursorVCol = lines[cursorRow].columnOf(cursorCol);
+    if (cursorRow < scrollRow) scrollRow = cursorRow;
+    if (cursorRow >= scrollRow + height - 1)
+      scrollRow = cursorRow - (height - 2);
+  }
+  void addLineAtBack(Line s) {
+    size_t vlength = wcswidthp(s);
+    lines.push_back(std::move(s), vlength);
+  }
+  void addLineAt(Line s, size_t i) {
+    size_t vlength = wcswidthp(s);
+    lines.insert(i, std::move(s), vlength);
+  }
+  // The last row the cursor can go to. While the file is still being
+  // loaded, the row past the end is off limits, since lines added there
+  // would end up before the ones that are yet to come.
+  size_t lastRow() const {
+    if (loading() && !lines.empty()) return lines.size() - 1;
+    return lines.size();
+  }
+  // The row after the last line has no text of its own,
+  // so it behaves as an empty line.
+  Line& currentLine() {
+    if (prompting) return promptInput;
+    if (cursorRow == lines.size()) {
+      pastEnd.clear();
+      return pastEnd;
+    }
+    return lines[cursorRow];
   }
-  void addLineAt(const std::string& s, size_t i) {
-    lines.insert(lines.begin() + i, s);
-    vlengths.insert(vlengths.begin() + i, wcswidthp(s));
+  size_t& currentVLength() {
+    if (prompting) return promptVLength;
+    if (cursorRow == lines.size()) {
+      pastEndVLength = 0;
+      return pastEndVLength;
+    }
+    return lines.vlength(cursorRow);
   }
-  void drawLineNo(std::string& output, size_t lineno) {
+  void drawLineNo(size_t row, size_t lineno) {
+    if (pager != nullptr) {
+      if (windowRow == SIZE_MAX) return;
+      lineno += windowRow;
+    }
+    lineno += firstRow;
     if (options.lineno()) {
       std::string lstr = toString(lineno + 1);
-      output += "\x1b[38;5;208m";
-      output += std::string(5 - lstr.length(), ' ');
-      output += lstr;
-      output += ' ';
-      output += "\x1b[0m";
-    }
-  }
-  size_t drawLine(const std::string& s, std::string& output, size_t lineno,
-      size_t start = 0, bool newline = true) {
-    // Draws the current line
-    size_t taken = 0;
-    if (newline) drawLineNo(output, lineno);
-    if (options.lineno() && newline) taken += 5;
-    UTF8Iterator<const std::string> it(s), end(s, true);
-    bool broken = false;
-    // - 1 to leave room for a $ in case we need more lines
+      lstr.insert(0, 5 - std::min<size_t>(lstr.length(), 5), ' ');
+      screen.print(row, 0, lstr, colour(208));
+    }
+  }
+  // Draws s from byte start onwards into the given row of the screen,
+  // beginning at column col. If s is line lineno of the buffer, any
+  // matches of highlight are shown as well.
+  void drawLine(const Line& s, size_t row, size_t col, size_t start = 0,
+      size_t lineno = SIZE_MAX) {
+    start = std::min(start, s.length());
+    // Find the matches that show up on screen.
+    std::vector<size_t> matches;
+    size_t m = highlight.length();
+    if (lineno != SIZE_MAX && m > 0) {
+      size_t shown = unwcswidthp(s, width - col, start);
+      size_t from = start >= m ? start - m + 1 : 0;
+      size_t to = shown + m - 1;
+      for (size_t at = s.find(highlight, from, to);
+          at != std::string::npos; at = s.find(highlight, at + 1, to))
+        matches.push_back(at);
+    }
+    size_t nextMatch = 0;
+    UTF8Iterator<const Line> it(s, start), end(s, true);
     while (it != end) {
       size_t oldPosition = it.position();
       int codepoint = it.getAndAdvance();
       size_t len = it.position() - oldPosition;
       size_t w = wcwidthp(codepoint);
-      if (taken + w >= width - 1 - start) {
-        broken = true;
+      uint32_t hl = A_PLAIN;
+      while (nextMatch < matches.size() &&
+          matches[nextMatch] + m <= oldPosition)
+        ++nextMatch;
+      if (nextMatch < matches.size() && matches[nextMatch] <= oldPosition) {
+        bool current = lineno == highlightRow &&
+          matches[nextMatch] == highlightCol;
+        hl = colour(current ? 2 : 3) | A_REVERSE;
+      }
+      // Leave room for a $ in case we need more columns
+      if (col + w > width - 1) {
+        screen.put(row, width - 1, "$", 1, 1, colour(4) | A_BOLD);
         break;
       }
-      // Append as-is
-      if (codepoint >= ' ')
-        output += s.substr(oldPosition, len);
       // Is it an invalid byte?
-      else if (codepoint < 0) {
+      if (codepoint < 0) {
         int byte = -codepoint;
         int high = (byte >> 4) & 15; // cut to 0 - 15 range for good measure
         int low = byte & 15;
-        output += "\x1b[7m"; // reverse video
-        output += HEX_DIGITS[high];
-        output += HEX_DIGITS[low];
-        output += "\x1b[0m"; // reset
+        // reverse video
+        col = screen.put(row, col, &HEX_DIGITS[high], 1, 1, A_REVERSE | hl);
+        col = screen.put(row, col, &HEX_DIGITS[low], 1, 1, A_REVERSE | hl);
       }
       // Is it tab?
       else if (codepoint == '\t') {
         for (size_t i = 0; i < TAB_WIDTH; ++i)
-          output += " ";
+          col = screen.put(row, col, " ", 1, 1, hl);
       }
       // Is it a control character?
       else if (codepoint < ' ') {
-        output += "\x1b[7m"; // reverse video
-        output += '^';
-        output += ('@' + codepoint);
-        output += "\x1b[0m"; // reset
+        char c = '@' + codepoint;
+        col = screen.put(row, col, "^", 1, 1, A_REVERSE | hl);
+        col = screen.put(row, col, &c, 1, 1, A_REVERSE | hl);
       }
       // Is it backspace?
       else if (codepoint == 127) {
-        output += "\x1b[7m^?\x1b[0m"; // reset
+        col = screen.put(row, col, "^", 1, 1, A_REVERSE | hl);
+        col = screen.put(row, col, "?", 1, 1, A_REVERSE | hl);
+      }
+      // Is it something else we can't print?
+      else if (widthTable.get(codepoint) < 0) {
+        col = screen.put(row, col, "?", 1, 1, A_REVERSE | hl);
+      }
+      // Draw as-is
+      else {
+        char bytes[4];
+        for (size_t i = 0; i < len && i < sizeof(bytes); ++i)
+          bytes[i] = s[oldPosition + i];
+        col = screen.put(row, col, bytes, len, w, hl);
       }
-      taken += len;
-    }
-    if (broken) {
-      output += "\x1b[9999C\x1b[34;1m$\x1b[0m";
-      if (newline) output += "\x1b[E";
     }
-    else if (newline) output += "\r\n";
-    return 1;
   }
-  void drawBlank(std::string& output, size_t lineno) {
-    drawLineNo(output, lineno);
-    output += "\x1b[34m~\x1b[0m\r\n";
+  void drawBlank(size_t row, size_t lineno) {
+    drawLineNo(row, lineno);
+    screen.print(row, options.lineno() ? 6 : 0, "~", colour(4));
   }
-  void drawMessage(std::string& output) {
-    output += "\x1b[3";
-    output += (char) ('0' + (messageColour & 7));
-    if ((messageColour & 8) != 0)
-      output += ";1";
-    output += "m";
-    output += message;
+  // Returns the column after the message.
+  size_t drawMessage(size_t row) {
+    return screen.print(row, 0, message, messageAttr(messageColour));
   }
   void saveIntractive(bool forcePrompt = false) {
+    // Saving half of what is coming in would look like saving all of it.
+    if (streaming()) {
+      say(M_STILL_STREAMING, 9);
+      return;
+    }
     std::string fname;
     if (filename == "" || forcePrompt) {
-      message = "Sydál kentos mej kemeṫys?";
-      messageColour = 14;
+      say(M_SAVE_AS, 14);
       bool stat1 = prompt();
       if (!stat1 || promptInput.empty()) {
-        message = "Syda kêl nelterus.";
-        messageColour = 1;
+        say(M_NOT_SAVED, 1);
         return;
       }
-      fname = promptInput;
+      fname = promptInput.str();
     } else fname = filename;
-    std::error_code stat = save(fname);
-    if (stat) {
-      message = "Syda kêl nelteġerus: ";
-      message += stat.message();
-      messageColour = 9;
-    } else {
-      message = "Syda nelterus.";
-      messageColour = 10;
-    }
-  }
-  std::error_code save(const std::string& fname) {
-    // Create the parent directory (if needed)
-    size_t lastSlash = fname.rfind('/');
-    if (lastSlash != std::string::npos) {
-      int stat = mkdirRecursive(fname.substr(0, lastSlash));
-      if (stat != 0) return std::error_code(stat, std::system_category());
-    }
-    // Create the actual file
-    std::ofstream out;
-    out.open(fname, std::ios::binary | std::ios::out);
-    // Output each line
-    for (const std::string& line : lines) {
-      out << line << '\n';
-    }
-    if (!out.good()) return std::error_code(errno, std::system_category());
-    dirty = false;
-    filename = fname;
-    return std::error_code();
+    save(fname);
   }
-  void promptMessage() {
-    std::string output;
-    output += "\x1b[";
-    output += std::to_string(height);
-    output += ";1H\x1b[0m";
-    for (size_t i = 0; i < width; ++i) output +=  ' ';
-    output += "\x1b[";
-    output += std::to_string(height);
-    output += ";1H";
-    drawMessage(output);
-    output += "  \x1b[0m";
-    write(0, output.c_str(), output.length());
+  // Starts writing the buffer to fname in the background. How it went
+  // is reported once it is done.
+  void save(const std::string& fname) {
+    finishLoading();
+    // One save at a time
+    finishSaving();
+    journalMark = journal.size();
+    saving = std::make_unique<SaveJob>(lines, mapping, fname, revision);
+  }
+  // Looks for text as it is typed, from the cursor on. Ctrl-F goes on
+  // to the next match, or brings back the last search if nothing has
+  // been typed yet. Enter leaves the cursor on the match.
+  void find() {
+    // Everything has to be there to be searched, or as much of a stream
+    // as has come in.
+    finishLoading();
+    size_t oldScrollRow = scrollRow;
+    size_t fromRow = cursorRow, fromCol = cursorCol;
+    bool found = false;
+    std::string needle;
+    // Takes the result of the search once it is in.
+    auto collect = [&]() {
+      if (searching == nullptr || !searching->done()) return;
+      size_t row, col;
+      found = searching->result(row, col);
+      searching.reset();
+      messageColour = found ? 14 : 9;
+      if (!found) return;
+      highlightRow = fromRow = row;
+      highlightCol = fromCol = col;
+      if (row < scrollRow || row >= scrollRow + height - 1)
+        scrollRow = row - std::min(row, (height - 1) / 2);
+    };
+    say(M_FIND, 14);
+    bool accepted = prompt([&](int keycode) {
+      bool next = false;
+      if (keycode == SpecialKeys::FIND) {
+        if (promptInput.empty()) {
+          insertText(lastFind);
+          horizontalScrollAdjust();
+        } else {
+          next = found;
+        }
+      }
+      collect();
+      std::string text = promptInput.str();
+      if (text == needle && !next) return;
+      needle = text;
+      highlight = text;
+      if (text.empty()) {
+        searching.reset();
+        found = false;
+        messageColour = 14;
+        return;
+      }
+      searching = std::make_unique<SearchJob>(
+        lines, text, fromRow, fromCol + (next ? 1 : 0));
+    });
+    if (searching != nullptr) {
+      searching->wait();
+      collect();
+    }
+    if (!accepted || !found) {
+      scrollRow = oldScrollRow;
+      highlight.clear();
+      if (accepted && !needle.empty()) {
+        say(M_NOT_FOUND, 9);
+      } else {
+        message = "";
+      }
+      return;
+    }
+    message = "";
+    lastFind = needle;
+    cursorRow = highlightRow;
+    cursorCol = highlightCol;
+    cursorVCol = lines[cursorRow].columnOf(cursorCol);
+  }
+  // How often the progress of a long job is shown, in milliseconds
+  static constexpr int PROGRESS_INTERVAL = 100;
+  // Replaces every match in the buffer as one edit, with the lines
+  // shared out among a pool of threads. A pattern between slashes is a
+  // regular expression, and $1 and so on in the replacement stand for
+  // what its groups matched.
+  void replaceAll() {
+    finishLoading();
+    say(M_REPLACE, 14);
+    if (!prompt() || promptInput.empty()) {
+      message = "";
+      return;
+    }
+    std::string pattern = promptInput.str();
+    message = text(M_WITH);
+    if (!prompt()) {
+      message = "";
+      return;
+    }
+    std::string with = promptInput.str();
+    std::unique_ptr<std::regex> re;
+    if (pattern.length() >= 2 && pattern.front() == '/' &&
+        pattern.back() == '/') {
+      try {
+        re = std::make_unique<std::regex>(
+          pattern.substr(1, pattern.length() - 2));
+      } catch (const std::regex_error& e) {
+        say(M_BAD_PATTERN, 9, e.what());
+        return;
+      }
+    }
+    auto job = std::make_unique<ReplaceJob>(lines, pattern, std::move(re),
+      with);
+    // Keys typed meanwhile wait their turn, except for Ctrl-Q. A replay
+    // has typed everything up front, so it just waits.
+    while (!headless() && !job->done()) {
+      say(M_REPLACING, 11, std::to_string(job->progress() / 10));
+      draw();
+      // Only one Ctrl-Q is taken; another one after it is for quitting.
+      if (keyboard.takeQuit()) {
+        job->cancel();
+        break;
+      }
+      if (!waitForInput(PROGRESS_INTERVAL)) waker.drain();
+    }
+    job->wait();
+    messageColour = 9;
+    if (!job->error().empty()) {
+      message = text(M_REPLACE_FAILED, job->error());
+      return;
+    }
+    if (job->wasCancelled()) {
+      message = text(M_REPLACE_CANCELLED);
+      return;
+    }
+    size_t skipped = job->skipped();
+    auto ranges = job->take();
+    // Let go of the snapshot, so that the lines changed below do not
+    // have to be copied first.
+    job.reset();
+    Edit all{cursorRow, cursorCol};
+    size_t total = 0;
+    for (const auto& changes : ranges) total += changes.size();
+    all.parts.reserve(total);
+    std::vector<size_t> rows;
+    for (auto& changes : ranges) {
+      rows.clear();
+      for (const auto& change : changes) rows.push_back(change.edit.row);
+      lines.update(rows, [&](size_t k, LineTree::Entry& entry) {
+        entry.text = std::move(changes[k].text);
+        entry.vlength = changes[k].vlength;
+        all.parts.push_back(std::move(changes[k].edit));
+      });
+      std::vector<ReplaceJob::Change>().swap(changes);
+    }
+    message = text(M_REPLACED, toString(all.parts.size()));
+    if (skipped > 0) message += text(M_TOO_LONG, toString(skipped));
+    messageColour = all.parts.empty() ? 9 : 10;
+    if (all.parts.empty()) return;
+    recordEdit(std::move(all));
+    touch();
+    cursorCol = std::min(cursorCol, currentLine().length());
+    cursorVCol = currentLine().columnOf(cursorCol);
   }
-  bool prompt() {
+  // Asks for a line of text after message. onKey, if given, is called
+  // after every key, and with SpecialKeys::UNKNOWN whenever a background
+  // job wakes us up.
+  bool prompt(const std::function<void(int)>& onKey = nullptr) {
     // Save cursor position
     size_t oldCol = cursorCol;
     size_t oldVCol = cursorVCol;
+    size_t oldScrollCol = scrollCol;
+    size_t oldScrollVCol = scrollVCol;
     prompting = true;
     cursorCol = 0;
     cursorVCol = 0;
-    promptInput = "";
-    promptMessage();
-    size_t offset = wcswidthp(message);
+    scrollCol = 0;
+    scrollVCol = 0;
+    promptInput.clear();
+    promptVLength = 0;
+    draw();
     int keycode = 0;
     bool done = false;
     while (true) {
-      if (resizeIfNecessary(true)) {
-        promptMessage();
-      } else {
-        keycode = getKey();
-        if (keycode == SpecialKeys::QUIT) break;
-        else if (keycode == SpecialKeys::ENTER) {
-          done = true;
-          break;
-        }
-        switch (keycode) {
-          case SpecialKeys::LEFT: left(); break;
-          case SpecialKeys::RIGHT: right(); break;
-          case SpecialKeys::BACKSPACE: backspace(); break;
-          case SpecialKeys::DELETE: del(); break;
-          case SpecialKeys::UNKNOWN: break;
-          default: if (keycode >= 0) insert(keycode);
-        }
+      if (!waitForKey()) {
+        waker.drain();
+        adoptLoaded();
+        if (onKey) onKey(SpecialKeys::UNKNOWN);
+        draw();
+        continue;
+      }
+      keycode = getKey();
+      if (keycode == SpecialKeys::QUIT) break;
+      else if (keycode == SpecialKeys::ENTER) {
+        done = true;
+        break;
+      }
+      switch (keycode) {
+        case SpecialKeys::LEFT: left(); break;
+        case SpecialKeys::RIGHT: right(); break;
+        case SpecialKeys::BACKSPACE: backspace(); break;
+        case SpecialKeys::DELETE: del(); break;
+        case SpecialKeys::PASTE: insertText(keyboard.pasted); break;
+        case SpecialKeys::UNKNOWN: break;
+        default: if (keycode >= 0) insert(keycode);
       }
-      std::string output;
-      // Move cursor 2 spaces after message
-      output += "\x1b[";
-      output += std::to_string(height);
-      output += ';';
-      output += std::to_string(offset + 3);
-      output += 'H';
-      for (size_t i = offset + 3; i < width; ++i) output += ' ';
-      output += "\x1b[";
-      output += std::to_string(height);
-      output += ';';
-      output += std::to_string(offset + 3);
-      output += 'H';
-      // Print message
-      drawLine(promptInput, output, 0, offset + 2, false);
-      write(0, output.c_str(), output.length());
+      horizontalScrollAdjust();
+      if (onKey) onKey(keycode);
+      draw();
     }
     prompting = false;
     // Restore cursor position
     cursorCol = oldCol;
     cursorVCol = oldVCol;
+    scrollCol = oldScrollCol;
+    scrollVCol = oldScrollVCol;
     return done;
   }
-  static void handler(int sig, siginfo_t* si, void* mydata) {
-    std::cout << '\a';
-    globalBuffer->shouldResize = true;
-  }
-  void registerHandler() {
-    globalBuffer = this;
-    struct sigaction handlerW;
-    handlerW.sa_flags = (SA_SIGINFO);
-    sigemptyset(&handlerW.sa_mask);
-    handlerW.sa_sigaction = handler;
-    if (sigaction(SIGWINCH, &handlerW, nullptr) == -1)
-      perror("sigaction");
-  }
-  bool resizeIfNecessary(bool autodraw = false) {
-    if (shouldResize) {
-      getTerminalDimensions(width, height);
-      shouldResize = false;
-      if (autodraw) draw();
-      return true;
-    }
-    return false;
+  bool resizeIfNecessary() {
+    if (headless() || !resizes.take()) return false;
+    getTerminalDimensions(width, height);
+    screen.resize(width, height);
+    if (pager != nullptr) fillWindow();
+    return true;
   }
 };
 
+// What the timings for a key are listed under
+const char* keyName(int keycode) {
+  switch (keycode) {
+    case SpecialKeys::UP: return "up";
+    case SpecialKeys::DOWN: return "down";
+    case SpecialKeys::LEFT: return "left";
+    case SpecialKeys::RIGHT: return "right";
+    case SpecialKeys::QUIT: return "quit";
+    case SpecialKeys::BACKSPACE: return "backspace";
+    case SpecialKeys::DELETE: return "delete";
+    case SpecialKeys::ENTER: return "enter";
+    case SpecialKeys::SAVE: return "save";
+    case SpecialKeys::SAVE_AS: return "save as";
+    case SpecialKeys::PASTE: return "paste";
+    case SpecialKeys::UNDO: return "undo";
+    case SpecialKeys::REDO: return "redo";
+    case SpecialKeys::FIND: return "find";
+    case SpecialKeys::REPLACE: return "replace";
+    case SpecialKeys::PAGE_UP: return "page up";
+    case SpecialKeys::PAGE_DOWN: return "page down";
+    case SpecialKeys::HOME: return "home";
+    case SpecialKeys::END: return "end";
+    default: return keycode >= 0 ? "text" : "other";
+  }
+}
+
+// Runs the editor without a terminal, taking keys from the file at
+// keysPath and drawing into memory. Reports how long it took to open
+// fname, to react to and draw each kind of key, and to finish saving.
+int replay(const char* keysPath, const char* fname) {
+  using Clock = std::chrono::steady_clock;
+  auto micros = [](Clock::time_point from) {
+    return std::chrono::duration<double, std::micro>(
+      Clock::now() - from).count();
+  };
+  int fd = open(keysPath, O_RDONLY);
+  if (fd < 0) {
+    perror(keysPath);
+    return 1;
+  }
+  keyboard = KeyReader(fd);
+  std::string sink;
+  size_t drawn = 0;
+  Buffer buffer(&sink);
+  auto start = Clock::now();
+  if (fname != nullptr) {
+    buffer.read(fname);
+    buffer.finishLoading();
+  }
+  double openTime = micros(start);
+  start = Clock::now();
+  buffer.draw();
+  double firstDraw = micros(start);
+  // The times for each kind of key, in microseconds
+  std::map<std::string, std::pair<std::vector<double>, std::vector<double>>>
+    times;
+  int keycode = 0;
+  while (keycode != SpecialKeys::QUIT) {
+    waker.drain();
+    buffer.reportSaved();
+    drawn += sink.length();
+    sink.clear();
+    keycode = getKey();
+    auto& entry = times[keyName(keycode)];
+    start = Clock::now();
+    buffer.react(keycode);
+    entry.first.push_back(micros(start));
+    start = Clock::now();
+    buffer.draw();
+    entry.second.push_back(micros(start));
+  }
+  start = Clock::now();
+  buffer.finishSaving();
+  double saveTime = micros(start);
+  drawn += sink.length();
+  close(fd);
+  printf("open %.0f us, first draw %.0f us, %zu lines\n",
+    openTime, firstDraw, buffer.lines.size());
+  printf("%-10s %8s %30s %30s\n", "key", "count",
+    "react mean/p99/max us", "draw mean/p99/max us");
+  for (auto& [name, pair] : times) {
+    std::string columns[2];
+    for (int i = 0; i < 2; ++i) {
+      std::vector<double>& v = i == 0 ? pair.first : pair.second;
+      std::sort(v.begin(), v.end());
+      double sum = 0;
+      for (double t : v) sum += t;
+      char text[64];
+      snprintf(text, sizeof(text), "%.1f/%.1f/%.1f", sum / v.size(),
+        v[v.size() * 99 / 100], v.back());
+      columns[i] = text;
+    }
+    printf("%-10s %8zu %30s %30s\n", name.c_str(), pair.first.size(),
+      columns[0].c_str(), columns[1].c_str());
+  }
+  printf("waiting for the save %.0f us, %zu bytes drawn\n", saveTime, drawn);
+  return 0;
+}
+
 int main(int argc, char** argv) {
   setlocale(LC_ALL, "");
+  guardMappings();
+  widthTable.build();
+  if (argc > 2 && strcmp(argv[1], "--replay") == 0)
+    return replay(argv[2], argc > 3 ? argv[3] : nullptr);
+  // With a pipe on stdin, the keys come from wherever stdin would have.
+  bool piped = !isatty(0);
+  if (piped) {
+    terminal = open("/dev/tty", O_RDWR | O_CLOEXEC);
+    if (terminal < 0) {
+      perror("/dev/tty");
+      return 1;
+    }
+    keyboard = KeyReader(terminal);
+  }
   saveCanonicalMode();
   setRawMode();
   atexit(restoreCanonicalMode);
@@ -1107,13 +5572,51 @@ int main(int argc, char** argv) {
   }
   */
   Buffer buffer;
-  if (argc > 1) buffer.read(argv[1]);
+  int arg = 1;
+  bool follow = false;
+  if (arg < argc && strcmp(argv[arg], "--view") == 0) {
+    buffer.viewOnly = true;
+    ++arg;
+  } else if (arg < argc && strcmp(argv[arg], "--follow") == 0) {
+    follow = true;
+    ++arg;
+  }
+  if (arg < argc) {
+    buffer.read(argv[arg]);
+    if (follow) buffer.follow();
+    else buffer.recover();
+  } else if (piped) {
+    buffer.readStream(0);
+  }
   int keycode = 0;
   buffer.draw();
   while (keycode != SpecialKeys::QUIT) {
-    keycode = buffer.shouldResize ? SpecialKeys::UNKNOWN : getKey();
-    //std::cout << keycode << "\r\n";
-    buffer.react(keycode);
+    if (!waitForKey()) {
+      // Woken up by a background thread or a resize rather than by a key
+      waker.drain();
+      buffer.adoptLoaded();
+      buffer.reportSaved();
+      buffer.checkFile();
+      buffer.draw();
+      continue;
+    }
+    // Deal with every key that has already come in before drawing
+    // anything, so that a paste or a held key costs one frame.
+    auto arrived = Stats::Clock::now();
+    do {
+      auto start = Stats::Clock::now();
+      keycode = getKey();
+      buffer.stats.record(Stats::KEY, start);
+      //std::cout << keycode << "\r\n";
+      start = Stats::Clock::now();
+      buffer.react(keycode);
+      buffer.stats.record(Stats::REACT, start);
+    } while (keycode != SpecialKeys::QUIT && keyPending());
+    // A prompt might have taken the wake-up meant for a finished save,
+    // or for a change to the file.
+    buffer.reportSaved();
+    buffer.checkFile();
     buffer.draw();
+    buffer.stats.record(Stats::TOTAL, arrived);
   }
 }